@@ -0,0 +1,321 @@
+/*
+COMPILE COMMAND:
+gcc -O2 -o bench bench.c -lGL -lGLU -lglut -lGLEW -lEGL -lm -lrt -lpthread
+
+Renders procedural scenes of N meshes x T triangles x L lights headless and prints
+the results as JSON, for example:
+./bench --meshes 1,16,64 --triangles 200,2000,20000 --lights 1,4,16 --frames 200 --out results.json
+*/
+
+#define CALIUM_NO_MAIN
+#include "renderer.c"
+
+#define BENCHMAXVALUES 16
+
+
+// One swept parameter, e.g. --meshes 1,16,64
+struct BenchSweep {
+    int values[BENCHMAXVALUES];
+    int count;
+};
+
+
+struct BenchResult {
+    int meshes;
+    int triangles;          // Per mesh, the torus rounds the requested amount
+    int lights;
+    int lightsevaluated;    // The shaders handle at most MAXSHADERLIGHTS
+    bool shaderlighting;
+
+    // Frame times in milliseconds, from the first draw until glFinish returns
+    double min, p50, p90, p99, max, mean;
+
+    double trianglespersecond;
+    double lighttrianglespersecond;
+};
+
+
+void ParseSweep(const char* text, struct BenchSweep* sweep) {
+    sweep->count = 0;
+    while (*text != '\0') {
+        if (sweep->count == BENCHMAXVALUES) {
+            printf("At most %d benchmark values per list: %s\n", BENCHMAXVALUES, text);
+            exit(1);
+        }
+
+        char* end;
+        long value = strtol(text, &end, 10);
+        if (end == text || value <= 0) {
+            printf("Invalid benchmark value list: %s\n", text);
+            exit(1);
+        }
+        sweep->values[sweep->count++] = (int)value;
+        text = *end == ',' ? end + 1 : end;
+    }
+}
+
+
+// A closed torus of about the requested amount of triangles, closed so CreateObject can orient it
+struct object CreateTorus(int triangles) {
+    int minor = (int)sqrt(triangles / 2.0);
+    if (minor < 3) {
+        minor = 3;
+    }
+    int major = triangles / (2 * minor);
+    if (major < 3) {
+        major = 3;
+    }
+
+    int count = major * minor * 2;
+    struct Triangle* faces = (struct Triangle*)calloc(count, sizeof(struct Triangle));
+    if (faces == NULL) {
+        printf("Memory allocation failed for the benchmark mesh\n");
+        exit(1);
+    }
+
+    const float ring = 1.0f, tube = 0.35f;
+    int t = 0;
+    for (int i = 0; i < major; i++) {
+        for (int j = 0; j < minor; j++) {
+            struct vertex corners[4];
+            for (int k = 0; k < 4; k++) {
+                int a = i + (k == 1 || k == 2), b = j + (k >= 2);
+                float theta = 2.0f * M_PI * a / major;
+                float phi = 2.0f * M_PI * b / minor;
+                corners[k] = (struct vertex){
+                    .x = (ring + tube * cosf(phi)) * cosf(theta),
+                    .y = (ring + tube * cosf(phi)) * sinf(theta),
+                    .z = tube * sinf(phi),
+                    .r = 1.0f, .g = 1.0f, .b = 1.0f, .a = 1.0f,
+                    .u = (float)a / major, .v = (float)b / minor
+                };
+            }
+            faces[t++] = (struct Triangle){corners[0], corners[1], corners[2], false};
+            faces[t++] = (struct Triangle){corners[0], corners[2], corners[3], false};
+        }
+    }
+
+    struct object torus = CreateObject(count, faces);
+    free(faces);
+    return torus;
+}
+
+
+int CompareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+double Percentile(const double* sorted, int count, double fraction) {
+    int index = (int)ceil(fraction * count) - 1;
+    return sorted[index < 0 ? 0 : index];
+}
+
+
+struct BenchResult RunBenchScene(int meshes, int triangles, int lightcount, bool shaderlighting, GLuint texture, int warmup, int frames) {
+    SHADERLIGHTING = shaderlighting;
+    struct object mesh = CreateTorus(triangles);
+
+    // Random lights in front of the meshes
+    struct Light* lights = (struct Light*)calloc(lightcount, sizeof(struct Light));
+    double* times = (double*)malloc(frames * sizeof(double));
+    if (lights == NULL || times == NULL) {
+        printf("Memory allocation failed for the benchmark scene\n");
+        exit(1);
+    }
+    for (int i = 0; i < lightcount; i++) {
+        lights[i].position = (struct vector3){Random() * 4.0f - 2.0f, Random() * 4.0f - 2.0f, 2.0f + Random() * 2.0f};
+        lights[i].color = (struct color){Random(), Random(), Random(), 1.0f};
+        lights[i].intensity = 5.0f / lightcount;
+    }
+
+    // Lay the meshes out on a square grid that fits in the view from the camera
+    int columns = (int)ceil(sqrt(meshes));
+    float cell = 3.6f / columns;
+    float scale = cell / 2.8f;
+
+    for (int frame = 0; frame < warmup + frames; frame++) {
+        long long start = MonotonicNanoseconds();
+
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        struct mat4 view = CameraMatrix();
+        glMatrixMode(GL_MODELVIEW);
+        glLoadMatrixf(view.m);
+        UpdateViewFrustum();
+
+        for (int i = 0; i < meshes; i++) {
+            struct Transform transform = {
+                .px = -1.8f + cell * (i % columns + 0.5f), .py = -1.8f + cell * (i / columns + 0.5f), .pz = 0.0f,
+                .sx = scale, .sy = scale, .sz = scale,
+                .rx = frame * 2.0f + i * 10.0f, .ry = frame * 3.0f, .rz = 0.0f
+            };
+            DrawMesh(mesh, transform, texture, lights, lightcount, false);
+        }
+
+        // Wait for the GPU, otherwise only the time to queue the commands would be measured
+        glFinish();
+
+        if (frame >= warmup) {
+            times[frame - warmup] = (MonotonicNanoseconds() - start) / 1e6;
+        }
+    }
+
+    struct BenchResult result = {
+        .meshes = meshes,
+        .triangles = mesh.trianglenum,
+        .lights = lightcount,
+        .lightsevaluated = shaderlighting && lightcount > MAXSHADERLIGHTS ? MAXSHADERLIGHTS : lightcount,
+        .shaderlighting = shaderlighting
+    };
+
+    double total = 0.0;
+    for (int i = 0; i < frames; i++) {
+        total += times[i];
+    }
+    qsort(times, frames, sizeof(double), CompareDoubles);
+
+    result.min = times[0];
+    result.p50 = Percentile(times, frames, 0.50);
+    result.p90 = Percentile(times, frames, 0.90);
+    result.p99 = Percentile(times, frames, 0.99);
+    result.max = times[frames - 1];
+    result.mean = total / frames;
+
+    double seconds = total / 1000.0;
+    double trianglesdrawn = (double)meshes * mesh.trianglenum * frames;
+    result.trianglespersecond = trianglesdrawn / seconds;
+    result.lighttrianglespersecond = trianglesdrawn * result.lightsevaluated / seconds;
+
+    DeleteObject(&mesh);
+    free(lights);
+    free(times);
+    return result;
+}
+
+
+void WriteBenchResult(FILE* out, const struct BenchResult* result, bool last) {
+    fprintf(out, "    {\"meshes\": %d, \"triangles_per_mesh\": %d, \"lights\": %d, \"lights_evaluated\": %d, \"lighting\": \"%s\",\n",
+            result->meshes, result->triangles, result->lights, result->lightsevaluated, result->shaderlighting ? "shader" : "cpu");
+    fprintf(out, "     \"frame_ms\": {\"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f, \"mean\": %.4f},\n",
+            result->min, result->p50, result->p90, result->p99, result->max, result->mean);
+    fprintf(out, "     \"triangles_per_second\": %.0f, \"light_triangles_per_second\": %.0f}%s\n",
+            result->trianglespersecond, result->lighttrianglespersecond, last ? "" : ",");
+}
+
+
+int main(int argc, char** argv) {
+    struct BenchSweep meshes, triangles, lights;
+    ParseSweep("1,8,64", &meshes);
+    ParseSweep("128,1024,8192", &triangles);
+    ParseSweep("1,4,16", &lights);
+    int frames = 60;
+    int warmup = 5;
+    bool shaderruns = true, cpuruns = true;
+    const char* outpath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--meshes") == 0 && i + 1 < argc) {
+            ParseSweep(argv[++i], &meshes);
+        }
+        else if (strcmp(argv[i], "--triangles") == 0 && i + 1 < argc) {
+            ParseSweep(argv[++i], &triangles);
+        }
+        else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+            ParseSweep(argv[++i], &lights);
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--lighting") == 0 && i + 1 < argc) {
+            // shader, cpu or both
+            const char* mode = argv[++i];
+            shaderruns = strcmp(mode, "cpu") != 0;
+            cpuruns = strcmp(mode, "shader") != 0;
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            // Job worker threads for the CPU lighting, -1 is one per core
+            JOBTHREADS = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            outpath = argv[++i];
+        }
+        else {
+            printf("Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (frames <= 0) {
+        printf("--frames must be at least 1\n");
+        return 1;
+    }
+    if (warmup < 0) {
+        printf("--warmup can not be negative\n");
+        return 1;
+    }
+
+    // The same lights and layouts every run, so results can be compared between builds
+    srand(1);
+
+    HEADLESS = true;
+    PROFILERHUD = false;
+    if (!CreateHeadlessContext()) {
+        return 1;
+    }
+    InitRenderer();
+    CreateHeadlessFramebuffer();
+
+    if (shaderruns && LightingProgram == 0) {
+        printf("Shader lighting unavailable, only benchmarking CPU lighting\n");
+        shaderruns = false;
+    }
+
+    GLuint texture = LoadTexture("cobblesmall.png");
+
+    FILE* out = stdout;
+    if (outpath != NULL) {
+        out = fopen(outpath, "w");
+        if (out == NULL) {
+            printf("Error opening %s for writing\n", outpath);
+            return 1;
+        }
+    }
+
+    fprintf(out, "{\n  \"renderer\": \"%s\",\n  \"lighting_kernel\": \"%s\",\n  \"job_workers\": %d,\n  \"width\": %d, \"height\": %d, \"frames\": %d, \"warmup\": %d,\n  \"results\": [\n",
+            (const char*)glGetString(GL_RENDERER), LightingKernelName, jobsystem.workercount, WIDTH, HEIGHT, frames, warmup);
+
+    int runs = (shaderruns + cpuruns) * meshes.count * triangles.count * lights.count;
+    int run = 0;
+    for (int mode = 0; mode < 2; mode++) {
+        bool shaderlighting = mode == 0;
+        if ((shaderlighting && !shaderruns) || (!shaderlighting && !cpuruns)) {
+            continue;
+        }
+
+        for (int m = 0; m < meshes.count; m++) {
+            for (int t = 0; t < triangles.count; t++) {
+                for (int l = 0; l < lights.count; l++) {
+                    fprintf(stderr, "[%d/%d] %s lighting, %d meshes, %d triangles, %d lights\n", run + 1, runs,
+                            shaderlighting ? "shader" : "cpu", meshes.values[m], triangles.values[t], lights.values[l]);
+                    struct BenchResult result = RunBenchScene(meshes.values[m], triangles.values[t], lights.values[l],
+                                                              shaderlighting, texture, warmup, frames);
+                    WriteBenchResult(out, &result, ++run == runs);
+                }
+            }
+        }
+    }
+
+    fprintf(out, "  ]\n}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    glDeleteTextures(1, &texture);
+    FreeRenderer();
+    DestroyHeadlessContext();
+    return 0;
+}
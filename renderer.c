@@ -1,25 +1,71 @@
 #define STB_IMAGE_IMPLEMENTATION
 
 #include <GL/glew.h>
+#include <GL/glxew.h>
 #include <GL/freeglut.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 #include "stb_image.h"
 #include <math.h> 
 #include <time.h>
 #include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CALIUM_X86 1
+#endif
 
 #define M_PI 3.14159265358979323846
 #define DEG_TO_RAD(deg) ((deg) * (M_PI / 180.0))
 #define TARGETFPS 60
 #define FRAMETIME (1000 / TARGETFPS)
+#define FRAMETIMENS (1000000000LL / TARGETFPS)
+#define SIMULATIONRATE 60                   // Fixed simulation updates per second
+#define SIMULATIONSTEP (1.0 / SIMULATIONRATE)
+#define SIMULATIONSTEPNS (1000000000LL / SIMULATIONRATE)
+#define ROTATIONSPEED 60.0f                 // Degrees per second the cubes spin
+#define CAMERASPEED 2.0f                    // Units per second the camera flies
+#define CAMERATURNSPEED 90.0f               // Degrees per second the camera turns
+#define WELDCREASEANGLE 60.0f
+#define MAXSHADERLIGHTS 16
+#define NEARPLANE 0.1f
+#define FARPLANE 100.0f
+#define INSTANCEATTRIBUTE 9     // First generic attribute slot used for per-instance data
+#define LAYERATTRIBUTE 6        // Generic attribute slot of the texture array layer, not aliased by any fixed function array
+#define PROFILEFRAMES 128       // Frames kept by the profiler for its statistics
+#define PROFILEREFRESH 30       // Frames between updates of the profiler overlay
+#define PACINGFRAMES 256        // Present intervals kept for the frame pacing statistics
+#define HUDSCALE 2              // Screen pixels per font pixel
+#define GPUTIMERFRAMES 3        // Sets of GPU queries in flight, results are read when a set comes around again
+#define GPUTIMERBATCHES 64      // Mesh batches per frame that get their own GPU timestamp
+#define MAXJOBTHREADS 64        // Threads that can push jobs, the workers included
+#define JOBDEQUESIZE 1024       // Jobs a thread can have queued at once, a power of two
+#define SHADEJOBGRAIN 2048      // Triangles per lighting job
+#define OBJREADSIZE (1 << 20)   // Bytes the OBJ loader reads at a time, also the longest line it takes
+#define TEXTURETHREADS 2        // Threads that read and decode textures for LoadTextureAsync
+#define TEXTUREUPLOADBUDGET (8 << 20)   // Bytes of decoded texture uploaded per frame, at least one texture goes
+#define MESHCACHEVERSION 1      // Bump whenever the cache layout or anything CreateObject computes changes
+#define ATLASPAGESIZE 2048      // Largest atlas page, smaller when GL_MAX_TEXTURE_SIZE is
+#define ATLASPADDING 4          // Edge texels repeated around every atlas image, a power of two
+#define ATLASVERSION 1          // Bump whenever the atlas layout format or the packing changes
 
 /*
 COMPILE COMMAND: 
-gcc -o renderer renderer.c -lGL -lGLU -lglut -lGLEW -lm -lrt
+gcc -o renderer renderer.c -lGL -lGLU -lglut -lGLEW -lEGL -lm -lrt -lpthread
 */
 
 // GLOBAL VARIABLES
@@ -30,10 +76,72 @@ float FOV = 45.0f;
 int OBJECTAMOUNT = 2;
 int LIGHTAMOUNT = 2;
 
+// Evaluate the lighting in GLSL instead of LambertianDiffuse on the CPU
+bool SHADERLIGHTING = true;
+
+// Skip objects whose bounds are outside the view frustum
+bool FRUSTUMCULLING = true;
+
+// Skip lighting triangles that face away from the camera (the GPU culls them anyway)
+bool CPUBACKFACECULL = true;
+
+// Draw the frame profiler overlay
+bool PROFILERHUD = true;
+
+// Where to write the per frame GPU timings as CSV, NULL to not write them
+const char* GPUTIMINGCSV = NULL;
+
+// Render this many frames into an offscreen framebuffer without a window, then exit
+bool HEADLESS = false;
+int HEADLESSFRAMES = 0;
+
+// Write every headless frame to <prefix>00000.png, <prefix>00001.png, ... NULL to not write them
+const char* FRAMEDUMPPREFIX = NULL;
+
+// Advance the simulation by exactly one frame time per frame instead of by the real elapsed time
+bool FIXEDFRAMETIME = false;
+
+// Run the simulation and the CPU lighting on their own thread while the GLUT thread renders
+bool SIMULATIONTHREAD = true;
+
+// Wavefront OBJ file drawn in place of the second and third cube, NULL for the cubes
+const char* MESHPATH = NULL;
+
+// Keep a binary copy of every loaded mesh next to its source and load that while it is current
+bool MESHCACHE = true;
+
+// Job worker threads, -1 for one per core besides the main thread, 0 runs every job inline
+int JOBTHREADS = -1;
+
+// Seed for Random(), the time unless --seed or a replay sets it
+unsigned int RANDOMSEED = 0;
+
+// Write the camera and every scene transform of each frame to this file, NULL to not record
+const char* RECORDPATH = NULL;
+
+// Draw the frames of a recording instead of simulating, NULL to simulate
+const char* REPLAYPATH = NULL;
+
+// Where to write the CPU time of every profiler zone per frame as CSV, NULL to not write them
+const char* FRAMETIMINGCSV = NULL;
+
+// Pack the textures into atlas pages and keep the layout in this file, NULL binds every texture on its own
+const char* ATLASPATH = NULL;
+
+// Load same sized textures as the layers of one array texture, so draws with different textures can share a batch
+bool TEXTUREARRAYS = false;
+
+// Swap interval, 1 waits for the vertical blank, 0 swaps right away and can tear, -1 is
+// adaptive: it waits for the blank unless the frame is already late, then it tears instead
+int SWAPINTERVAL = 1;
+
 // Texture ID
 GLuint* TextureIDs = NULL;
 int TextureCount = 0;
 
+// Layer of every TextureIDs slot in its array texture, -1 for a plain 2D texture
+int* TextureLayers = NULL;
+
 
 struct vertex {
     float x, y, z;
@@ -47,6 +155,11 @@ struct color {
 };
 
 
+struct vector3 {
+    float x, y, z;
+};
+
+
 struct Transform {
     float px, py, pz;
     float sx, sy, sz;
@@ -62,12 +175,36 @@ struct Triangle {
 
 struct object {
 	int trianglenum;
-	struct Triangle* triangles;
-};
 
-
-struct vector3 {
-    float x, y, z;
+    // Vertex storage built by CreateObject. Indexed meshes keep only the unique
+    // vertices plus an index list, non-indexed meshes keep 3 vertices per triangle
+    int vertexnum;
+    struct vertex* vertices;
+    int indexnum;               // 0 for the non-indexed layout
+    void* indices;
+    GLenum indextype;           // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    float* vertexweights;       // 1 / number of triangles sharing each vertex
+
+    // Object space face data, computed once by CreateObject
+    struct vector3* facenormals;
+    struct vector3* centroids;
+
+    // Object space bounds, computed once by CreateObject
+    struct vector3 boundsmin, boundsmax;    // Axis aligned box
+    struct vector3 boundcenter;             // Bounding sphere
+    float boundradius;
+
+    // GPU side of the mesh, uploaded once by CreateObject
+    GLuint vao;
+    GLuint vbo;         // Static interleaved struct vertex data
+    GLuint ebo;         // Index buffer, 0 for the non-indexed layout
+    GLuint normalvbo;   // Per-vertex normals for the shader lighting path
+    GLuint colorvbo;    // Per-vertex shade, rewritten by DrawMesh every lit frame
+    struct color* shades;
+
+    // Mesh cache the vertex, index and face arrays point into, NULL when they were allocated
+    void* mapping;
+    size_t mappingsize;
 };
 
 
@@ -93,455 +230,5993 @@ struct color *colorptr;
 struct Light *lightptr;
 
 
+// SCRATCH SPACE FOR THE BATCHED CPU LIGHTING, one for DrawMesh and one per draw of a scene snapshot
+struct MeshLighting RenderLighting;
+struct MeshLighting* SceneLighting;
+
+// FRAME RENDER QUEUE
+struct RenderQueue renderqueue;
+
+// SHADER LIGHTING PROGRAM
+GLuint LightingProgram = 0;
+GLuint InstancedLightingProgram = 0;
+
+// Variants that sample a layer of an array texture, also used for CPU lighting and flat shading
+GLuint LayeredLightingProgram = 0;
+GLuint InstancedLayeredLightingProgram = 0;
+
+// STREAM BUFFER FOR PER-INSTANCE DATA
+GLuint InstanceBuffer = 0;
+
 // VECTOR3 ZERO
 struct vector3 VZERO = {0.0f, 0.0f, 0.0f};
 
 
 // The camera position
 struct Transform camerapos = {
-    .px=0.0f, .py=0.0f, .pz=0.0f,
+    .px=0.0f, .py=0.0f, .pz=5.0f,
     .rx=0.0f, .ry=0.0f, .rz=0.0f
 };
 
 
-void fpsLimiter(int value) {
-    glutPostRedisplay();  // Schedule a redraw
-    glutTimerFunc(FRAMETIME, fpsLimiter, 0);  // Call again after FRAME_TIME ms
+// Everything the simulation advances in fixed steps
+struct SimulationState {
+    float angle;
+    struct Transform camera;
+};
+
+// Camera movement keys that are held down, set by the GLUT thread and read by the simulation
+enum CameraInput {
+    CAMERA_FORWARD = 1 << 0,
+    CAMERA_BACK = 1 << 1,
+    CAMERA_LEFT = 1 << 2,
+    CAMERA_RIGHT = 1 << 3,
+    CAMERA_UP = 1 << 4,
+    CAMERA_DOWN = 1 << 5,
+    CAMERA_TURNLEFT = 1 << 6,
+    CAMERA_TURNRIGHT = 1 << 7,
+    CAMERA_TURNUP = 1 << 8,
+    CAMERA_TURNDOWN = 1 << 9
+};
+
+atomic_int CameraKeys = 0;
+
+void MoveCamera(struct Transform* camera, int keys, float dt);
+
+// The two most recent simulation steps, frames are interpolated between them
+struct SimulationState previousstate = {0};
+struct SimulationState currentstate = {0};
+double simulationaccumulator = 0.0;
+
+// Absolute time the next frame is due
+struct timespec nextframe;
+
+
+long long MonotonicNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
 
-void rotatePoint3D(float* x, float* y, float* z, float angleX, float angleY, float angleZ) {
-    // Convert degrees to radians
-    float radX = angleX * (M_PI / 180.0f);
-    float radY = angleY * (M_PI / 180.0f);
-    float radZ = angleZ * (M_PI / 180.0f);
+void UpdateSimulation(struct SimulationState* state, double dt) {
+    state->angle += ROTATIONSPEED * dt;
+    MoveCamera(&state->camera, atomic_load_explicit(&CameraKeys, memory_order_relaxed), (float)dt);
+}
 
-    // Rotation matrix for X-axis
-    float cosX = cos(radX);
-    float sinX = sin(radX);
 
-    // Rotation matrix for Y-axis
-    float cosY = cos(radY);
-    float sinY = sin(radY);
+struct Transform LerpTransform(struct Transform a, struct Transform b, float t) {
+    return (struct Transform){
+        .px = a.px + (b.px - a.px) * t, .py = a.py + (b.py - a.py) * t, .pz = a.pz + (b.pz - a.pz) * t,
+        .sx = a.sx + (b.sx - a.sx) * t, .sy = a.sy + (b.sy - a.sy) * t, .sz = a.sz + (b.sz - a.sz) * t,
+        .rx = a.rx + (b.rx - a.rx) * t, .ry = a.ry + (b.ry - a.ry) * t, .rz = a.rz + (b.rz - a.rz) * t
+    };
+}
 
-    // Rotation matrix for Z-axis
-    float cosZ = cos(radZ);
-    float sinZ = sin(radZ);
 
-    // Step 1: Rotate around X-axis
-    float tempY = *y * cosX - *z * sinX;
-    float tempZ = *y * sinX + *z * cosX;
-    *y = tempY;
-    *z = tempZ;
+struct SimulationState InterpolateSimulation(struct SimulationState a, struct SimulationState b, float alpha) {
+    return (struct SimulationState){
+        .angle = a.angle + (b.angle - a.angle) * alpha,
+        .camera = LerpTransform(a.camera, b.camera, alpha)
+    };
+}
 
-    // Step 2: Rotate around Y-axis
-    float tempX = *z * sinY + *x * cosY;
-    *z = *z * cosY - *x * sinY;
-    *x = tempX;
 
-    // Step 3: Rotate around Z-axis
-    tempX = *x * cosZ - *y * sinZ;
-    tempY = *x * sinZ + *y * cosZ;
-    *x = tempX;
-    *y = tempY;
+// Runs as many fixed steps as the elapsed time allows and returns the interpolation alpha
+float AdvanceSimulation() {
+    static long long lasttime = 0;
+    long long now = MonotonicNanoseconds();
+    if (lasttime == 0) {
+        lasttime = now;
+    }
+
+    if (FIXEDFRAMETIME) {
+        simulationaccumulator += 1.0 / TARGETFPS;
+    }
+    else {
+        // Do not try to catch up on more than a quarter second, e.g. after a breakpoint
+        simulationaccumulator += fmin((now - lasttime) / 1e9, 0.25);
+    }
+    lasttime = now;
+
+    while (simulationaccumulator >= SIMULATIONSTEP) {
+        previousstate = currentstate;
+        UpdateSimulation(&currentstate, SIMULATIONSTEP);
+        simulationaccumulator -= SIMULATIONSTEP;
+    }
+
+    // The leftover time says how far we are into the next step, the frame is drawn that far
+    // between the previous and the current state
+    return (float)(simulationaccumulator / SIMULATIONSTEP);
 }
 
 
-struct vector3 WorldspaceToCameraSpace(struct vector3 position) {
-    float x = position.x - camerapos.px;
-    float y = position.y - camerapos.py;
-    float z = position.z - camerapos.pz;
+// Sleeps until the next frame is due, the deadline is absolute so the error never adds up
+void WaitForNextFrame() {
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &nextframe, NULL);
 
-    rotatePoint3D(&x, &y, &z, camerapos.rx, camerapos.ry, camerapos.rz);
-    return (struct vector3){x, y, z};
+    nextframe.tv_nsec += FRAMETIMENS;
+    while (nextframe.tv_nsec >= 1000000000L) {
+        nextframe.tv_nsec -= 1000000000L;
+        nextframe.tv_sec++;
+    }
+
+    // When a frame ran long, start counting from now instead of rushing to catch up
+    long long due = (long long)nextframe.tv_sec * 1000000000LL + nextframe.tv_nsec;
+    long long now = MonotonicNanoseconds();
+    if (now - due > FRAMETIMENS) {
+        clock_gettime(CLOCK_MONOTONIC, &nextframe);
+    }
 }
 
 
-struct object CreateObject(int trianglenum, struct Triangle* triangles) {
-    struct object newObject;
-    newObject.trianglenum = trianglenum;
+// Stages of a frame that the profiler times
+enum ProfileZone {
+    PROFILE_SIMULATION,
+    PROFILE_LIGHTING,
+    PROFILE_SUBMIT,
+    PROFILE_HUD,
+    PROFILE_SWAP,
+    PROFILE_FRAME,
+    PROFILEZONES
+};
 
-    // Allocate memory for the triangles array
-    newObject.triangles = (struct Triangle*)malloc(trianglenum * sizeof(struct Triangle));
-    if (newObject.triangles == NULL) {
-        printf("Memory allocation failed for triangles\n");
-        exit(1);
+const char* ProfileZoneNames[PROFILEZONES] = {"SIM", "LIGHT", "SUBMIT", "HUD", "SWAP", "FRAME"};
+
+// Nanoseconds spent in every zone during one frame
+struct ProfileFrame {
+    long long zones[PROFILEZONES];
+};
+
+struct ProfileStats {
+    double min;
+    double avg;
+    double p99;
+};
+
+// The render thread is the only writer. It fills current, then publishes it into the ring
+// by bumping written with release order, so readers never need a lock.
+struct Profiler {
+    struct ProfileFrame frames[PROFILEFRAMES];
+    struct ProfileFrame current;
+    atomic_uint written;
+    struct ProfileStats stats[PROFILEZONES];  // In milliseconds
+    FILE* csv;                                // Every frame, when FRAMETIMINGCSV is set
+};
+
+struct Profiler profiler = {0};
+
+
+long long ProfileBegin() {
+    return MonotonicNanoseconds();
+}
+
+
+// Zones can be entered several times a frame, e.g. once per mesh, their times add up
+void ProfileEnd(enum ProfileZone zone, long long start) {
+    profiler.current.zones[zone] += MonotonicNanoseconds() - start;
+}
+
+
+// For time measured somewhere else, e.g. on another thread
+void ProfileAdd(enum ProfileZone zone, long long nanoseconds) {
+    profiler.current.zones[zone] += nanoseconds;
+}
+
+
+void ProfileEndFrame() {
+    unsigned int written = atomic_load_explicit(&profiler.written, memory_order_relaxed);
+    if (profiler.csv != NULL) {
+        fprintf(profiler.csv, "%u", written);
+        for (int zone = 0; zone < PROFILEZONES; zone++) {
+            fprintf(profiler.csv, ",%.4f", profiler.current.zones[zone] / 1e6);
+        }
+        fprintf(profiler.csv, "\n");
     }
 
-    // Copy data from the input array into the new object
-    for (int i = 0; i < trianglenum; i++) {
-        newObject.triangles[i] = triangles[i]; // Copy triangle data
+    profiler.frames[written % PROFILEFRAMES] = profiler.current;
+    atomic_store_explicit(&profiler.written, written + 1, memory_order_release);
+    profiler.current = (struct ProfileFrame){0};
+}
+
+
+void InitProfiler() {
+    if (FRAMETIMINGCSV == NULL) {
+        return;
     }
 
-    return newObject;
+    profiler.csv = fopen(FRAMETIMINGCSV, "w");
+    if (profiler.csv == NULL) {
+        printf("Error opening %s for the frame timings\n", FRAMETIMINGCSV);
+        return;
+    }
+
+    // One column per zone in milliseconds, e.g. frame,sim,light,submit,hud,swap,frame
+    fprintf(profiler.csv, "frame");
+    for (int zone = 0; zone < PROFILEZONES; zone++) {
+        fprintf(profiler.csv, ",");
+        for (const char* c = ProfileZoneNames[zone]; *c != '\0'; c++) {
+            fputc(*c - 'A' + 'a', profiler.csv);
+        }
+        fprintf(profiler.csv, "_ms");
+    }
+    fprintf(profiler.csv, "\n");
 }
 
 
-GLuint LoadTexture(const char* filename) {
-    // Load the image data using stb_image
-    int width, height, channels;
-    stbi_set_flip_vertically_on_load(1);
-    unsigned char* img_data = stbi_load(filename, &width, &height, &channels, 0);
-    if (img_data == NULL) {
-        printf("Error in loading texture image: %s\n", filename);
-        return 0; // Return 0 if there's an error
+void FreeProfiler() {
+    if (profiler.csv != NULL) {
+        fclose(profiler.csv);
+        profiler.csv = NULL;
     }
+}
 
-    // Generate the OpenGL texture ID
-    GLuint textureID;
-    glGenTextures(1, &textureID);
-    glBindTexture(GL_TEXTURE_2D, textureID);
 
-    // Set texture parameters (e.g., filtering, wrapping)
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+// Min, average and 99th percentile of every zone over the frames in the ring. Only the
+// slowest 1% of the frames matter for the percentile, so they are kept in a small sorted
+// list instead of sorting every sample.
+void ProfileComputeStats() {
+    unsigned int written = atomic_load_explicit(&profiler.written, memory_order_acquire);
+    int count = written < PROFILEFRAMES ? (int)written : PROFILEFRAMES;
+    if (count == 0) {
+        return;
+    }
 
-    // Load the texture data into OpenGL
-    GLenum format = GL_RGB;
-    if (channels == 4) {
-        format = GL_RGBA; // If the image has an alpha channel
+    // The percentile is the smallest of the slowest frames
+    int slowcount = count - ((int)ceil(count * 0.99) - 1);
+
+    for (int zone = 0; zone < PROFILEZONES; zone++) {
+        long long slowest[PROFILEFRAMES / 100 + 2];
+        int kept = 0;
+        long long total = 0;
+        long long min = profiler.frames[0].zones[zone];
+
+        for (int i = 0; i < count; i++) {
+            long long sample = profiler.frames[i].zones[zone];
+            total += sample;
+            if (sample < min) {
+                min = sample;
+            }
+
+            // Insert into the descending list of the slowest frames
+            if (kept < slowcount || sample > slowest[kept - 1]) {
+                int at = kept < slowcount ? kept++ : kept - 1;
+                while (at > 0 && slowest[at - 1] < sample) {
+                    slowest[at] = slowest[at - 1];
+                    at--;
+                }
+                slowest[at] = sample;
+            }
+        }
+
+        profiler.stats[zone].min = min / 1e6;
+        profiler.stats[zone].avg = total / (double)count / 1e6;
+        profiler.stats[zone].p99 = slowest[slowcount - 1] / 1e6;
     }
-    
-    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, img_data);
-    glGenerateMipmap(GL_TEXTURE_2D); // Optionally generate mipmaps
+}
 
-    // Free the image data as it's now loaded into OpenGL
-    stbi_image_free(img_data);
 
-    // Return the texture ID
-    return textureID;
+// Frame pacing, the time between one present and the next. A steady frame rate with the
+// odd long frame looks worse than a lower one without, and the average hides those frames,
+// so every interval is kept and the ones that missed the TARGETFPS deadline are counted.
+struct FramePacing {
+    long long lastpresent;
+    long long intervals[PACINGFRAMES];
+    int written;
+    int missed;                 // Since the last report
+    int presented;              // Since the last report
+    long long worst;            // Longest interval since the last report
+
+    // Over the intervals in the ring, in milliseconds
+    double mean;
+    double jitter;              // Standard deviation
+    int ringmissed;
+};
+
+struct FramePacing pacing = {0};
+
+
+// A present is late when it comes more than half a frame after its deadline, with vsync
+// that means at least one vertical blank was missed
+bool FrameMissedDeadline(long long interval) {
+    return interval > FRAMETIMENS + FRAMETIMENS / 2;
 }
 
 
-struct vector3 crossProduct(struct vector3 a, struct vector3 b) {
-    struct vector3 result;
-    result.x = a.y * b.z - a.z * b.y;
-    result.y = a.z * b.x - a.x * b.z;
-    result.z = a.x * b.y - a.y * b.x;
-    return result;
+// Call right after the swap. The swap returning is the closest the application gets to
+// the actual present without blocking on the GPU.
+void RecordPresent() {
+    long long now = MonotonicNanoseconds();
+    if (pacing.lastpresent != 0) {
+        long long interval = now - pacing.lastpresent;
+        pacing.intervals[pacing.written++ % PACINGFRAMES] = interval;
+        pacing.presented++;
+        if (FrameMissedDeadline(interval)) {
+            pacing.missed++;
+        }
+        if (interval > pacing.worst) {
+            pacing.worst = interval;
+        }
+    }
+    pacing.lastpresent = now;
 }
 
-// Function to compute the dot product of two vectors
-float dotProduct(struct vector3 a, struct vector3 b) {
-    return a.x * b.x + a.y * b.y + a.z * b.z;
+
+const char* SwapIntervalName(int interval) {
+    return interval == 0 ? "off" : interval < 0 ? "adaptive" : "vsync";
 }
 
-// Function to normalize a vector
-struct vector3 normalize(struct vector3 v) {
-    float length = sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
-    v.x /= length;
-    v.y /= length;
-    v.z /= length;
-    return v;
+
+// Starts over, e.g. after the swap interval changed and the old intervals no longer apply
+void ResetFramePacing() {
+    pacing = (struct FramePacing){0};
+}
+
+
+void FramePacingComputeStats() {
+    int count = pacing.written < PACINGFRAMES ? pacing.written : PACINGFRAMES;
+    if (count == 0) {
+        return;
+    }
+
+    double total = 0.0;
+    int missed = 0;
+    for (int i = 0; i < count; i++) {
+        total += pacing.intervals[i];
+        missed += FrameMissedDeadline(pacing.intervals[i]);
+    }
+    double mean = total / count;
+
+    double variance = 0.0;
+    for (int i = 0; i < count; i++) {
+        double difference = pacing.intervals[i] - mean;
+        variance += difference * difference;
+    }
+
+    pacing.mean = mean / 1e6;
+    pacing.jitter = sqrt(variance / count) / 1e6;
+    pacing.ringmissed = missed;
+}
+
+
+void FramePacingReport() {
+    if (pacing.presented == 0) {
+        return;
+    }
+
+    FramePacingComputeStats();
+    printf("Frame pacing: %d of %d frames missed the %.2f ms deadline, worst %.2f ms, mean %.3f ms, jitter %.3f ms\n",
+           pacing.missed, pacing.presented, FRAMETIMENS / 1e6, pacing.worst / 1e6, pacing.mean, pacing.jitter);
+    pacing.missed = 0;
+    pacing.presented = 0;
+    pacing.worst = 0;
+}
+
+
+// GPU side timing. CPU zones only see how long it takes to hand commands to the driver,
+// so every pass gets a GL_TIME_ELAPSED query and every mesh batch a GL_TIMESTAMP.
+// Results are read GPUTIMERFRAMES - 1 frames late, by then they are normally done and
+// reading them never waits on the GPU.
+enum GpuPass {
+    GPUPASS_SCENE,
+    GPUPASS_HUD,
+    GPUPASSES
+};
+
+const char* GpuPassNames[GPUPASSES] = {"scene", "hud"};
+
+struct GpuTimerFrame {
+    GLuint passqueries[GPUPASSES];
+    GLuint stampqueries[GPUTIMERBATCHES + 1];   // One before the first batch and one after each
+    bool passused[GPUPASSES];
+    int stampcount;
+    long long frame;                            // Frame these queries were issued in, -1 when unused
+};
+
+struct GpuTimer {
+    struct GpuTimerFrame frames[GPUTIMERFRAMES];
+    struct GpuTimerFrame* current;
+    long long frame;
+    bool supported;
+    int dropped;                                // Frames whose results were not ready in time
+
+    // Latest resolved results in milliseconds
+    long long resultframe;
+    double passes[GPUPASSES];
+    double batches[GPUTIMERBATCHES];
+    int batchcount;
+
+    FILE* csv;
+};
+
+struct GpuTimer gputimer = {0};
+
+
+void InitGpuTimer(const char* csvpath) {
+    gputimer.supported = GLEW_ARB_timer_query || GLEW_VERSION_3_3;
+    if (!gputimer.supported) {
+        printf("GPU timer queries are not supported, GPU timings are disabled\n");
+        return;
+    }
+
+    for (int i = 0; i < GPUTIMERFRAMES; i++) {
+        glGenQueries(GPUPASSES, gputimer.frames[i].passqueries);
+        glGenQueries(GPUTIMERBATCHES + 1, gputimer.frames[i].stampqueries);
+        gputimer.frames[i].frame = -1;
+    }
+    gputimer.resultframe = -1;
+
+    if (csvpath != NULL) {
+        gputimer.csv = fopen(csvpath, "w");
+        if (gputimer.csv == NULL) {
+            printf("Error opening GPU timing file: %s\n", csvpath);
+        }
+        else {
+            fprintf(gputimer.csv, "frame,pass,index,ms\n");
+        }
+    }
+}
+
+
+// Reads back a set of queries if the GPU is done with them, otherwise the frame is skipped
+void ResolveGpuTimerFrame(struct GpuTimerFrame* set) {
+    if (set->frame < 0) {
+        return;
+    }
+
+    // Every query that is read has to be ready, reading one that is not would stall until the
+    // GPU catches up. The pass queries end after the last stamp, so checking one is not enough.
+    GLuint available = GL_TRUE;
+    for (int pass = 0; pass < GPUPASSES && available; pass++) {
+        if (set->passused[pass]) {
+            glGetQueryObjectuiv(set->passqueries[pass], GL_QUERY_RESULT_AVAILABLE, &available);
+        }
+    }
+    for (int i = 0; i < set->stampcount && available; i++) {
+        glGetQueryObjectuiv(set->stampqueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+    }
+    if (!available) {
+        gputimer.dropped++;
+        set->frame = -1;
+        return;
+    }
+
+    // llvmpipe measures the first queries of a context from before it has started any work,
+    // which gives nonsense for the first frame
+    if (set->frame == 0) {
+        set->frame = -1;
+        return;
+    }
+
+    gputimer.resultframe = set->frame;
+    for (int pass = 0; pass < GPUPASSES; pass++) {
+        GLuint64 elapsed = 0;
+        if (set->passused[pass]) {
+            glGetQueryObjectui64v(set->passqueries[pass], GL_QUERY_RESULT, &elapsed);
+        }
+        gputimer.passes[pass] = elapsed / 1e6;
+    }
+
+    GLuint64 previous = 0;
+    gputimer.batchcount = set->stampcount > 0 ? set->stampcount - 1 : 0;
+    for (int i = 0; i < set->stampcount; i++) {
+        GLuint64 stamp;
+        glGetQueryObjectui64v(set->stampqueries[i], GL_QUERY_RESULT, &stamp);
+        if (i > 0) {
+            gputimer.batches[i - 1] = (stamp - previous) / 1e6;
+        }
+        previous = stamp;
+    }
+
+    if (gputimer.csv != NULL) {
+        for (int pass = 0; pass < GPUPASSES; pass++) {
+            if (set->passused[pass]) {
+                fprintf(gputimer.csv, "%lld,%s,0,%.6f\n", set->frame, GpuPassNames[pass], gputimer.passes[pass]);
+            }
+        }
+        for (int i = 0; i < gputimer.batchcount; i++) {
+            fprintf(gputimer.csv, "%lld,batch,%d,%.6f\n", set->frame, i, gputimer.batches[i]);
+        }
+    }
+
+    set->frame = -1;
+}
+
+
+void GpuTimerBeginFrame() {
+    if (!gputimer.supported) {
+        return;
+    }
+
+    // This set was issued GPUTIMERFRAMES frames ago, read it before reusing the queries
+    struct GpuTimerFrame* set = &gputimer.frames[gputimer.frame % GPUTIMERFRAMES];
+    ResolveGpuTimerFrame(set);
+
+    set->frame = gputimer.frame++;
+    set->stampcount = 0;
+    for (int pass = 0; pass < GPUPASSES; pass++) {
+        set->passused[pass] = false;
+    }
+    gputimer.current = set;
+}
+
+
+// Passes can not overlap, GL only allows one GL_TIME_ELAPSED query at a time
+void GpuTimerBeginPass(enum GpuPass pass) {
+    if (!gputimer.supported) {
+        return;
+    }
+    gputimer.current->passused[pass] = true;
+    glBeginQuery(GL_TIME_ELAPSED, gputimer.current->passqueries[pass]);
+}
+
+
+void GpuTimerEndPass() {
+    if (!gputimer.supported) {
+        return;
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+}
+
+
+// Records when the GPU gets to this point, call it before the first mesh batch and after each one
+void GpuTimerStamp() {
+    if (!gputimer.supported || gputimer.current->stampcount > GPUTIMERBATCHES) {
+        return;
+    }
+
+    struct GpuTimerFrame* set = gputimer.current;
+    glQueryCounter(set->stampqueries[set->stampcount++], GL_TIMESTAMP);
+}
+
+
+void GpuTimerReport() {
+    if (!gputimer.supported || gputimer.resultframe < 0) {
+        return;
+    }
+
+    printf("GPU frame %lld: scene %.3f ms, hud %.3f ms, %d batches, %d frames not ready in time\n",
+           gputimer.resultframe, gputimer.passes[GPUPASS_SCENE], gputimer.passes[GPUPASS_HUD],
+           gputimer.batchcount, gputimer.dropped);
+}
+
+
+void FreeGpuTimer() {
+    if (!gputimer.supported) {
+        return;
+    }
+
+    for (int i = 0; i < GPUTIMERFRAMES; i++) {
+        glDeleteQueries(GPUPASSES, gputimer.frames[i].passqueries);
+        glDeleteQueries(GPUTIMERBATCHES + 1, gputimer.frames[i].stampqueries);
+    }
+    if (gputimer.csv != NULL) {
+        fclose(gputimer.csv);
+    }
+    gputimer = (struct GpuTimer){0};
+}
+
+
+// Engine wide job system. Every thread that pushes jobs gets a Chase-Lev deque: the owner
+// pushes and pops at the bottom, other threads steal from the top, and only a steal of the
+// last job needs a compare and swap. Jobs count an atomic counter down when they finish and
+// JobWait runs other jobs until the counter it waits for reaches zero.
+typedef void (*JobFunction)(void* data, int start, int end);
+
+struct Job {
+    JobFunction function;
+    void* data;
+    int start, end;
+    int grain;                  // Ranges bigger than this split in half, the other half becomes a child job
+    atomic_int* counter;
+};
+
+struct JobDeque {
+    atomic_long top;
+    atomic_long bottom;
+    struct Job jobs[JOBDEQUESIZE];
+};
+
+struct JobSystem {
+    struct JobDeque* deques;
+    atomic_int threadcount;     // Deques handed out so far
+    pthread_t workers[MAXJOBTHREADS];
+    int workercount;
+    atomic_bool running;
+
+    // Idle workers sleep until a job is pushed, the lock is only taken when someone sleeps
+    atomic_int pending;
+    atomic_int sleepers;
+    pthread_mutex_t sleeplock;
+    pthread_cond_t wakeup;
+};
+
+struct JobSystem jobsystem = {.sleeplock = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER};
+_Thread_local int JobThreadIndex = -1;
+
+
+// The deque of the calling thread, NULL when jobs have to run inline
+struct JobDeque* JobThreadDeque() {
+    if (!atomic_load_explicit(&jobsystem.running, memory_order_relaxed)) {
+        return NULL;
+    }
+    if (JobThreadIndex < 0) {
+        int index = atomic_fetch_add(&jobsystem.threadcount, 1);
+        if (index >= MAXJOBTHREADS) {
+            atomic_fetch_sub(&jobsystem.threadcount, 1);
+            return NULL;
+        }
+        JobThreadIndex = index;
+    }
+    return &jobsystem.deques[JobThreadIndex];
+}
+
+
+bool JobDequePush(struct JobDeque* deque, const struct Job* job) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= JOBDEQUESIZE - 1) {
+        return false;
+    }
+
+    deque->jobs[bottom & (JOBDEQUESIZE - 1)] = *job;
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return true;
+}
+
+
+// Owner only, takes the newest job
+bool JobDequePop(struct JobDeque* deque, struct Job* job) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+
+    *job = deque->jobs[bottom & (JOBDEQUESIZE - 1)];
+    if (top == bottom) {
+        // The last job, a thief may be after it too
+        bool won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+
+// Any thread, takes the oldest job, which is usually the biggest piece of a split range
+bool JobDequeSteal(struct JobDeque* deque, struct Job* job) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return false;
+    }
+
+    *job = deque->jobs[top & (JOBDEQUESIZE - 1)];
+    return atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+
+void RunJob(struct Job job);
+
+
+void JobPush(const struct Job* job) {
+    struct JobDeque* deque = JobThreadDeque();
+    if (deque == NULL || !JobDequePush(deque, job)) {
+        RunJob(*job);
+        return;
+    }
+
+    atomic_fetch_add(&jobsystem.pending, 1);
+    if (atomic_load(&jobsystem.sleepers) > 0) {
+        pthread_mutex_lock(&jobsystem.sleeplock);
+        pthread_cond_signal(&jobsystem.wakeup);
+        pthread_mutex_unlock(&jobsystem.sleeplock);
+    }
+}
+
+
+// Own jobs first, then steal from the other threads starting with the next one
+bool JobTake(struct Job* job) {
+    struct JobDeque* own = JobThreadDeque();
+    if (own == NULL) {
+        return false;
+    }
+
+    bool found = JobDequePop(own, job);
+    int threads = atomic_load_explicit(&jobsystem.threadcount, memory_order_acquire);
+    for (int i = 1; !found && i < threads; i++) {
+        found = JobDequeSteal(&jobsystem.deques[(JobThreadIndex + i) % threads], job);
+    }
+
+    if (found) {
+        atomic_fetch_sub(&jobsystem.pending, 1);
+    }
+    return found;
+}
+
+
+// Splits off the upper halves as child jobs until the range is small enough, then runs the rest
+void RunJob(struct Job job) {
+    while (job.end - job.start > job.grain) {
+        struct Job child = job;
+        child.start = job.start + (job.end - job.start) / 2;
+        job.end = child.start;
+
+        atomic_fetch_add_explicit(job.counter, 1, memory_order_relaxed);
+        JobPush(&child);
+    }
+
+    job.function(job.data, job.start, job.end);
+    atomic_fetch_sub_explicit(job.counter, 1, memory_order_release);
+}
+
+
+void JobWait(atomic_int* counter) {
+    while (atomic_load_explicit(counter, memory_order_acquire) > 0) {
+        struct Job job;
+        if (JobTake(&job)) {
+            RunJob(job);
+        }
+        else {
+            // The rest is running on other threads
+            sched_yield();
+        }
+    }
+}
+
+
+// Calls function on ranges of [0, count) of at most grain items, spread over the workers
+void ParallelFor(JobFunction function, void* data, int count, int grain) {
+    if (count <= 0) {
+        return;
+    }
+
+    atomic_int counter = 1;
+    struct Job job = {function, data, 0, count, grain < 1 ? 1 : grain, &counter};
+    RunJob(job);
+    JobWait(&counter);
+}
+
+
+void* JobWorker(void* unused) {
+    (void)unused;
+    JobThreadDeque();
+
+    while (atomic_load(&jobsystem.running)) {
+        struct Job job;
+        if (JobTake(&job)) {
+            RunJob(job);
+            continue;
+        }
+
+        pthread_mutex_lock(&jobsystem.sleeplock);
+        atomic_fetch_add(&jobsystem.sleepers, 1);
+        while (atomic_load(&jobsystem.running) && atomic_load(&jobsystem.pending) == 0) {
+            pthread_cond_wait(&jobsystem.wakeup, &jobsystem.sleeplock);
+        }
+        atomic_fetch_sub(&jobsystem.sleepers, 1);
+        pthread_mutex_unlock(&jobsystem.sleeplock);
+    }
+
+    return NULL;
+}
+
+
+void InitJobSystem(int workers) {
+    if (workers < 0) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    }
+    if (workers > MAXJOBTHREADS / 2) {
+        workers = MAXJOBTHREADS / 2;
+    }
+    if (workers <= 0) {
+        return;
+    }
+
+    jobsystem.deques = (struct JobDeque*)calloc(MAXJOBTHREADS, sizeof(struct JobDeque));
+    if (jobsystem.deques == NULL) {
+        printf("Memory allocation failed for the job system\n");
+        exit(1);
+    }
+    atomic_store(&jobsystem.running, true);
+
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&jobsystem.workers[i], NULL, JobWorker, NULL) != 0) {
+            printf("Could only start %d job threads\n", i);
+            break;
+        }
+        jobsystem.workercount++;
+    }
+}
+
+
+void FreeJobSystem() {
+    if (!atomic_load(&jobsystem.running)) {
+        return;
+    }
+
+    pthread_mutex_lock(&jobsystem.sleeplock);
+    atomic_store(&jobsystem.running, false);
+    pthread_cond_broadcast(&jobsystem.wakeup);
+    pthread_mutex_unlock(&jobsystem.sleeplock);
+
+    for (int i = 0; i < jobsystem.workercount; i++) {
+        pthread_join(jobsystem.workers[i], NULL);
+    }
+    free(jobsystem.deques);
+    jobsystem.deques = NULL;
+    jobsystem.workercount = 0;
+    atomic_store(&jobsystem.threadcount, 0);
+}
+
+
+void rotatePoint3D(float* x, float* y, float* z, float angleX, float angleY, float angleZ) {
+    // Convert degrees to radians
+    float radX = angleX * (M_PI / 180.0f);
+    float radY = angleY * (M_PI / 180.0f);
+    float radZ = angleZ * (M_PI / 180.0f);
+
+    // Rotation matrix for X-axis
+    float cosX = cos(radX);
+    float sinX = sin(radX);
+
+    // Rotation matrix for Y-axis
+    float cosY = cos(radY);
+    float sinY = sin(radY);
+
+    // Rotation matrix for Z-axis
+    float cosZ = cos(radZ);
+    float sinZ = sin(radZ);
+
+    // Step 1: Rotate around X-axis
+    float tempY = *y * cosX - *z * sinX;
+    float tempZ = *y * sinX + *z * cosX;
+    *y = tempY;
+    *z = tempZ;
+
+    // Step 2: Rotate around Y-axis
+    float tempX = *z * sinY + *x * cosY;
+    *z = *z * cosY - *x * sinY;
+    *x = tempX;
+
+    // Step 3: Rotate around Z-axis
+    tempX = *x * cosZ - *y * sinZ;
+    tempY = *x * sinZ + *y * cosZ;
+    *x = tempX;
+    *y = tempY;
+}
+
+
+// Column major 4x4 matrix, laid out the way glMultMatrixf expects
+struct mat4 {
+    float m[16];
+};
+
+
+struct mat4 IdentityMatrix() {
+    struct mat4 result = {{0}};
+    result.m[0] = result.m[5] = result.m[10] = result.m[15] = 1.0f;
+    return result;
+}
+
+
+struct mat4 MultiplyMatrix(struct mat4 a, struct mat4 b) {
+    struct mat4 result;
+    for (int column = 0; column < 4; column++) {
+        for (int row = 0; row < 4; row++) {
+            result.m[column * 4 + row] =
+                a.m[0 * 4 + row] * b.m[column * 4 + 0] +
+                a.m[1 * 4 + row] * b.m[column * 4 + 1] +
+                a.m[2 * 4 + row] * b.m[column * 4 + 2] +
+                a.m[3 * 4 + row] * b.m[column * 4 + 3];
+        }
+    }
+    return result;
+}
+
+
+// Same rotation as rotatePoint3D (X, then Y, then Z), but the trig is only done once
+struct mat4 RotationMatrix(float angleX, float angleY, float angleZ) {
+    float cosX = cos(DEG_TO_RAD(angleX)), sinX = sin(DEG_TO_RAD(angleX));
+    float cosY = cos(DEG_TO_RAD(angleY)), sinY = sin(DEG_TO_RAD(angleY));
+    float cosZ = cos(DEG_TO_RAD(angleZ)), sinZ = sin(DEG_TO_RAD(angleZ));
+
+    struct mat4 rotX = IdentityMatrix();
+    rotX.m[5] = cosX;  rotX.m[9] = -sinX;
+    rotX.m[6] = sinX;  rotX.m[10] = cosX;
+
+    struct mat4 rotY = IdentityMatrix();
+    rotY.m[0] = cosY;  rotY.m[8] = sinY;
+    rotY.m[2] = -sinY; rotY.m[10] = cosY;
+
+    struct mat4 rotZ = IdentityMatrix();
+    rotZ.m[0] = cosZ;  rotZ.m[4] = -sinZ;
+    rotZ.m[1] = sinZ;  rotZ.m[5] = cosZ;
+
+    return MultiplyMatrix(rotZ, MultiplyMatrix(rotY, rotX));
+}
+
+
+// Rotation part of TransformMatrix. glRotatef calls post multiply, so the Z rotation reaches the vertex first
+struct mat4 ModelRotationMatrix(struct Transform transform) {
+    return MultiplyMatrix(RotationMatrix(transform.rx, 0.0f, 0.0f),
+           MultiplyMatrix(RotationMatrix(0.0f, transform.ry, 0.0f),
+                          RotationMatrix(0.0f, 0.0f, transform.rz)));
+}
+
+
+// Model matrix matching glTranslatef, glScalef and glRotatef around X, Y and Z in that order
+struct mat4 TransformMatrix(struct Transform transform) {
+    struct mat4 translation = IdentityMatrix();
+    translation.m[12] = transform.px;
+    translation.m[13] = transform.py;
+    translation.m[14] = transform.pz;
+
+    struct mat4 scale = IdentityMatrix();
+    scale.m[0] = transform.sx;
+    scale.m[5] = transform.sy;
+    scale.m[10] = transform.sz;
+
+    return MultiplyMatrix(translation, MultiplyMatrix(scale, ModelRotationMatrix(transform)));
+}
+
+
+// Transforms normals the way TransformMatrix transforms points: rotation times inverse scale
+struct mat4 NormalMatrix(struct Transform transform) {
+    struct mat4 inversescale = IdentityMatrix();
+    inversescale.m[0] = (transform.sx != 0.0f) ? 1.0f / transform.sx : 0.0f;
+    inversescale.m[5] = (transform.sy != 0.0f) ? 1.0f / transform.sy : 0.0f;
+    inversescale.m[10] = (transform.sz != 0.0f) ? 1.0f / transform.sz : 0.0f;
+
+    return MultiplyMatrix(inversescale, ModelRotationMatrix(transform));
+}
+
+
+// A negative scale mirrors the mesh and turns its winding around
+bool TransformMirrored(struct Transform transform) {
+    return transform.sx * transform.sy * transform.sz < 0.0f;
+}
+
+
+// Transforms count points by a matrix, in and out may be the same array
+void TransformPoints(const struct mat4* matrix, const struct vector3* in, struct vector3* out, int count) {
+    const float* m = matrix->m;
+    for (int i = 0; i < count; i++) {
+        float x = in[i].x, y = in[i].y, z = in[i].z;
+        out[i].x = m[0] * x + m[4] * y + m[8] * z + m[12];
+        out[i].y = m[1] * x + m[5] * y + m[9] * z + m[13];
+        out[i].z = m[2] * x + m[6] * y + m[10] * z + m[14];
+    }
+}
+
+
+// Same as TransformPoints but ignores the translation, for normals and directions
+void TransformDirections(const struct mat4* matrix, const struct vector3* in, struct vector3* out, int count) {
+    const float* m = matrix->m;
+    for (int i = 0; i < count; i++) {
+        float x = in[i].x, y = in[i].y, z = in[i].z;
+        out[i].x = m[0] * x + m[4] * y + m[8] * z;
+        out[i].y = m[1] * x + m[5] * y + m[9] * z;
+        out[i].z = m[2] * x + m[6] * y + m[10] * z;
+    }
+}
+
+
+// View matrix of any camera, safe to call from every thread
+struct mat4 ViewMatrix(struct Transform camera) {
+    struct mat4 translation = IdentityMatrix();
+    translation.m[12] = -camera.px;
+    translation.m[13] = -camera.py;
+    translation.m[14] = -camera.pz;
+
+    return MultiplyMatrix(RotationMatrix(camera.rx, camera.ry, camera.rz), translation);
+}
+
+
+// View matrix of camerapos, cached while the camera stays put. Render thread only.
+struct mat4 CameraMatrix() {
+    static struct Transform cached;
+    static struct mat4 view;
+    static bool valid = false;
+
+    if (!valid || memcmp(&cached, &camerapos, sizeof(struct Transform)) != 0) {
+        view = ViewMatrix(camerapos);
+        cached = camerapos;
+        valid = true;
+    }
+
+    return view;
+}
+
+
+// Flies the camera along its own axes for the held keys
+void MoveCamera(struct Transform* camera, int keys, float dt) {
+    if (keys == 0) {
+        return;
+    }
+
+    float turn = CAMERATURNSPEED * dt;
+    camera->ry += turn * (((keys & CAMERA_TURNRIGHT) != 0) - ((keys & CAMERA_TURNLEFT) != 0));
+    camera->rx += turn * (((keys & CAMERA_TURNDOWN) != 0) - ((keys & CAMERA_TURNUP) != 0));
+
+    // The rows of the view rotation are the camera axes in world space, it looks down -Z
+    struct mat4 rotation = RotationMatrix(camera->rx, camera->ry, camera->rz);
+    float right = (float)(((keys & CAMERA_RIGHT) != 0) - ((keys & CAMERA_LEFT) != 0));
+    float up = (float)(((keys & CAMERA_UP) != 0) - ((keys & CAMERA_DOWN) != 0));
+    float back = (float)(((keys & CAMERA_BACK) != 0) - ((keys & CAMERA_FORWARD) != 0));
+
+    float step = CAMERASPEED * dt;
+    camera->px += step * (right * rotation.m[0] + up * rotation.m[1] + back * rotation.m[2]);
+    camera->py += step * (right * rotation.m[4] + up * rotation.m[5] + back * rotation.m[6]);
+    camera->pz += step * (right * rotation.m[8] + up * rotation.m[9] + back * rotation.m[10]);
+}
+
+
+void WorldspaceToCameraSpaceBatch(const struct vector3* in, struct vector3* out, int count) {
+    struct mat4 view = CameraMatrix();
+    TransformPoints(&view, in, out, count);
+}
+
+
+struct vector3 WorldspaceToCameraSpace(struct vector3 position) {
+    struct vector3 result;
+    WorldspaceToCameraSpaceBatch(&position, &result, 1);
+    return result;
+}
+
+// Same matrix gluPerspective builds
+struct mat4 PerspectiveMatrix(float fov, float aspect, float znear, float zfar) {
+    float f = 1.0f / tan(DEG_TO_RAD(fov) / 2.0f);
+
+    struct mat4 result = {{0}};
+    result.m[0] = f / aspect;
+    result.m[5] = f;
+    result.m[10] = (zfar + znear) / (znear - zfar);
+    result.m[11] = -1.0f;
+    result.m[14] = (2.0f * zfar * znear) / (znear - zfar);
+    return result;
+}
+
+
+// Six planes (a, b, c, d) in world space, the inside satisfies a*x + b*y + c*z + d >= 0
+struct Frustum {
+    float planes[6][4];
+};
+
+struct Frustum ViewFrustum;
+
+
+// Frustum of the projection settings seen from camera
+void BuildFrustum(struct Frustum* frustum, struct Transform camera) {
+    struct mat4 projection = PerspectiveMatrix(FOV, (float)WIDTH / (float)HEIGHT, NEARPLANE, FARPLANE);
+    struct mat4 clip = MultiplyMatrix(projection, ViewMatrix(camera));
+    const float* m = clip.m;
+
+    // Gribb/Hartmann: each plane is the last row plus or minus one of the other rows
+    for (int i = 0; i < 6; i++) {
+        int row = i / 2;
+        float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+        float* plane = frustum->planes[i];
+
+        plane[0] = m[3] + sign * m[row];
+        plane[1] = m[7] + sign * m[4 + row];
+        plane[2] = m[11] + sign * m[8 + row];
+        plane[3] = m[15] + sign * m[12 + row];
+
+        float length = sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        for (int j = 0; j < 4; j++) {
+            plane[j] /= length;
+        }
+    }
+}
+
+
+// Rebuilds ViewFrustum from the projection settings and the camera, once per frame
+void UpdateViewFrustum() {
+    BuildFrustum(&ViewFrustum, camerapos);
+}
+
+
+bool SphereInFrustum(const struct Frustum* frustum, struct vector3 center, float radius) {
+    for (int i = 0; i < 6; i++) {
+        const float* plane = frustum->planes[i];
+        if (plane[0] * center.x + plane[1] * center.y + plane[2] * center.z + plane[3] < -radius) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Tests the object's bounding sphere, moved by the transform, against a frustum
+bool ObjectInFrustum(const struct Frustum* frustum, const struct object* Object, struct Transform transform) {
+    if (!FRUSTUMCULLING) {
+        return true;
+    }
+
+    struct mat4 model = TransformMatrix(transform);
+    struct vector3 center;
+    TransformPoints(&model, &Object->boundcenter, &center, 1);
+
+    float scale = fmaxf(fabsf(transform.sx), fmaxf(fabsf(transform.sy), fabsf(transform.sz)));
+    return SphereInFrustum(frustum, center, Object->boundradius * scale);
+}
+
+
+// Tests the object against ViewFrustum, the frustum of the frame being drawn
+bool ObjectVisible(const struct object* Object, struct Transform transform) {
+    return ObjectInFrustum(&ViewFrustum, Object, transform);
+}
+
+
+
+struct vector3 crossProduct(struct vector3 a, struct vector3 b) {
+    struct vector3 result;
+    result.x = a.y * b.z - a.z * b.y;
+    result.y = a.z * b.x - a.x * b.z;
+    result.z = a.x * b.y - a.y * b.x;
+    return result;
+}
+
+// Function to compute the dot product of two vectors
+float dotProduct(struct vector3 a, struct vector3 b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+// Function to normalize a vector
+struct vector3 normalize(struct vector3 v) {
+    float length = sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+    v.x /= length;
+    v.y /= length;
+    v.z /= length;
+    return v;
+}
+
+
+// Function to compute the unit normal of a triangle from its winding, zero if degenerate
+struct vector3 FaceNormal(struct vector3 A, struct vector3 B, struct vector3 C) {
+    struct vector3 AB = {B.x - A.x, B.y - A.y, B.z - A.z};
+    struct vector3 AC = {C.x - A.x, C.y - A.y, C.z - A.z};
+
+    struct vector3 normal = crossProduct(AB, AC);
+    float length = sqrt(dotProduct(normal, normal));
+    if (length > 0.0f) {
+        normal.x /= length;
+        normal.y /= length;
+        normal.z /= length;
+    }
+    return normal;
+}
+
+
+// Returns the vertex index used by corner n (0 .. trianglenum * 3 - 1) of the mesh
+unsigned int ObjectIndex(const struct object* Object, int n) {
+    if (Object->indexnum == 0) {
+        return n;
+    }
+    if (Object->indextype == GL_UNSIGNED_SHORT) {
+        return ((const GLushort*)Object->indices)[n];
+    }
+    return ((const GLuint*)Object->indices)[n];
+}
+
+
+unsigned int HashVertex(const struct vertex* v) {
+    // FNV-1a over the raw bytes of the vertex
+    const unsigned char* bytes = (const unsigned char*)v;
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(struct vertex); i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+void WeldVertices(struct object* Object, struct Triangle* triangles) {
+    int cornernum = Object->trianglenum * 3;
+
+    // Open addressing table at most half full, holding vertex index + 1 (0 means empty)
+    int tablesize = 1;
+    while (tablesize < cornernum * 2) {
+        tablesize <<= 1;
+    }
+
+    unsigned int* table = (unsigned int*)calloc(tablesize, sizeof(unsigned int));
+    unsigned int* corners = (unsigned int*)malloc(cornernum * sizeof(unsigned int));
+    struct vector3* weldnormals = (struct vector3*)malloc(cornernum * sizeof(struct vector3));
+    Object->vertices = (struct vertex*)malloc(cornernum * sizeof(struct vertex));
+    if (table == NULL || corners == NULL || weldnormals == NULL || Object->vertices == NULL) {
+        printf("Memory allocation failed for vertex welding\n");
+        exit(1);
+    }
+
+    // Vertices are only shared between faces closer than the crease angle,
+    // so hard edges like the sides of a cube keep their own flat shading
+    float creasecos = cos(DEG_TO_RAD(WELDCREASEANGLE));
+
+    int vertexnum = 0;
+    for (int n = 0; n < cornernum; n++) {
+        struct Triangle* t = &triangles[n / 3];
+        struct vertex v = (n % 3 == 0) ? t->v1 : (n % 3 == 1) ? t->v2 : t->v3;
+
+        struct vector3 facenormal = FaceNormal(
+            (struct vector3){t->v1.x, t->v1.y, t->v1.z},
+            (struct vector3){t->v2.x, t->v2.y, t->v2.z},
+            (struct vector3){t->v3.x, t->v3.y, t->v3.z}
+        );
+
+        // Adding zero turns -0.0 into 0.0 so both hash and compare the same
+        v.x += 0.0f; v.y += 0.0f; v.z += 0.0f;
+        v.r += 0.0f; v.g += 0.0f; v.b += 0.0f; v.a += 0.0f;
+        v.u += 0.0f; v.v += 0.0f;
+
+        unsigned int slot = HashVertex(&v) & (tablesize - 1);
+        while (table[slot] != 0) {
+            unsigned int candidate = table[slot] - 1;
+            if (memcmp(&Object->vertices[candidate], &v, sizeof(struct vertex)) == 0 &&
+                dotProduct(weldnormals[candidate], facenormal) >= creasecos) {
+                break;
+            }
+            slot = (slot + 1) & (tablesize - 1);
+        }
+
+        if (table[slot] == 0) {
+            Object->vertices[vertexnum] = v;
+            weldnormals[vertexnum] = facenormal;
+            table[slot] = ++vertexnum;
+        }
+        corners[n] = table[slot] - 1;
+    }
+
+    Object->vertexnum = vertexnum;
+    Object->vertices = (struct vertex*)realloc(Object->vertices, vertexnum * sizeof(struct vertex));
+
+    // Use 16 bit indices whenever the mesh is small enough
+    Object->indexnum = cornernum;
+    if (vertexnum <= 65536) {
+        GLushort* indices = (GLushort*)malloc(cornernum * sizeof(GLushort));
+        if (indices == NULL) {
+            printf("Memory allocation failed for indices\n");
+            exit(1);
+        }
+        for (int n = 0; n < cornernum; n++) {
+            indices[n] = (GLushort)corners[n];
+        }
+        Object->indices = indices;
+        Object->indextype = GL_UNSIGNED_SHORT;
+        free(corners);
+    }
+    else {
+        Object->indices = corners;
+        Object->indextype = GL_UNSIGNED_INT;
+    }
+
+    free(weldnormals);
+    free(table);
+}
+
+
+void ComputeBounds(struct object* Object) {
+    if (Object->vertexnum == 0) {
+        Object->boundsmin = Object->boundsmax = Object->boundcenter = VZERO;
+        Object->boundradius = 0.0f;
+        return;
+    }
+
+    struct vertex* v = Object->vertices;
+    Object->boundsmin = (struct vector3){v[0].x, v[0].y, v[0].z};
+    Object->boundsmax = Object->boundsmin;
+    for (int i = 1; i < Object->vertexnum; i++) {
+        Object->boundsmin.x = fminf(Object->boundsmin.x, v[i].x);
+        Object->boundsmin.y = fminf(Object->boundsmin.y, v[i].y);
+        Object->boundsmin.z = fminf(Object->boundsmin.z, v[i].z);
+        Object->boundsmax.x = fmaxf(Object->boundsmax.x, v[i].x);
+        Object->boundsmax.y = fmaxf(Object->boundsmax.y, v[i].y);
+        Object->boundsmax.z = fmaxf(Object->boundsmax.z, v[i].z);
+    }
+
+    // Sphere around the box center, sized to the farthest vertex
+    Object->boundcenter = (struct vector3){
+        (Object->boundsmin.x + Object->boundsmax.x) / 2,
+        (Object->boundsmin.y + Object->boundsmax.y) / 2,
+        (Object->boundsmin.z + Object->boundsmax.z) / 2
+    };
+
+    float radius2 = 0.0f;
+    for (int i = 0; i < Object->vertexnum; i++) {
+        struct vector3 d = {v[i].x - Object->boundcenter.x, v[i].y - Object->boundcenter.y, v[i].z - Object->boundcenter.z};
+        radius2 = fmaxf(radius2, dotProduct(d, d));
+    }
+    Object->boundradius = sqrt(radius2);
+}
+
+
+void ComputeFaceData(struct object* Object) {
+    Object->facenormals = (struct vector3*)malloc(Object->trianglenum * sizeof(struct vector3));
+    Object->centroids = (struct vector3*)malloc(Object->trianglenum * sizeof(struct vector3));
+    if (Object->facenormals == NULL || Object->centroids == NULL) {
+        printf("Memory allocation failed for face data\n");
+        exit(1);
+    }
+
+    // The mesh is static, so normals and centers only have to be computed once
+    for (int i = 0; i < Object->trianglenum; i++) {
+        struct vertex* a = &Object->vertices[ObjectIndex(Object, i * 3 + 0)];
+        struct vertex* b = &Object->vertices[ObjectIndex(Object, i * 3 + 1)];
+        struct vertex* c = &Object->vertices[ObjectIndex(Object, i * 3 + 2)];
+
+        struct vector3 A = {a->x, a->y, a->z};
+        struct vector3 B = {b->x, b->y, b->z};
+        struct vector3 C = {c->x, c->y, c->z};
+
+        Object->facenormals[i] = FaceNormal(A, B, C);
+        Object->centroids[i] = (struct vector3){
+            (A.x + B.x + C.x) / 3,
+            (A.y + B.y + C.y) / 3,
+            (A.z + B.z + C.z) / 3
+        };
+    }
+}
+
+
+// Shared vertices get the average shade of the triangles that use them
+void ComputeVertexWeights(struct object* Object) {
+    Object->vertexweights = (float*)calloc(Object->vertexnum, sizeof(float));
+    if (Object->vertexweights == NULL) {
+        printf("Memory allocation failed for mesh buffers\n");
+        exit(1);
+    }
+
+    for (int n = 0; n < Object->trianglenum * 3; n++) {
+        Object->vertexweights[ObjectIndex(Object, n)] += 1.0f;
+    }
+    for (int i = 0; i < Object->vertexnum; i++) {
+        if (Object->vertexweights[i] > 0.0f) {
+            Object->vertexweights[i] = 1.0f / Object->vertexweights[i];
+        }
+    }
+}
+
+
+// Vertex normals for the shader path, averaged over the faces sharing each vertex
+struct vector3* ComputeVertexNormals(const struct object* Object) {
+    struct vector3* normals = (struct vector3*)calloc(Object->vertexnum, sizeof(struct vector3));
+    if (normals == NULL) {
+        printf("Memory allocation failed for vertex normals\n");
+        exit(1);
+    }
+
+    for (int n = 0; n < Object->trianglenum * 3; n++) {
+        unsigned int index = ObjectIndex(Object, n);
+        struct vector3 facenormal = Object->facenormals[n / 3];
+        normals[index].x += facenormal.x * Object->vertexweights[index];
+        normals[index].y += facenormal.y * Object->vertexweights[index];
+        normals[index].z += facenormal.z * Object->vertexweights[index];
+    }
+    return normals;
+}
+
+
+// Creates the VAO and GPU buffers straight from the vertex, index and normal arrays,
+// which may point into a mapped mesh cache
+void UploadObjectBuffers(struct object* Object, const struct vector3* normals) {
+    int vertexnum = Object->vertexnum;
+
+    Object->shades = (struct color*)malloc(vertexnum * sizeof(struct color));
+    if (Object->shades == NULL) {
+        printf("Memory allocation failed for mesh buffers\n");
+        exit(1);
+    }
+    for (int i = 0; i < vertexnum; i++) {
+        Object->shades[i] = WHITE;
+    }
+
+    glGenVertexArrays(1, &Object->vao);
+    glBindVertexArray(Object->vao);
+
+    // Positions and texture coordinates never change, so they go in a static buffer
+    glGenBuffers(1, &Object->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, Object->vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertexnum * sizeof(struct vertex), Object->vertices, GL_STATIC_DRAW);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(struct vertex), (void*)offsetof(struct vertex, x));
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(struct vertex), (void*)offsetof(struct vertex, u));
+
+    // The shading is recomputed on the CPU every frame, so it lives in its own stream buffer
+    glGenBuffers(1, &Object->colorvbo);
+    glBindBuffer(GL_ARRAY_BUFFER, Object->colorvbo);
+    glBufferData(GL_ARRAY_BUFFER, vertexnum * sizeof(struct color), Object->shades, GL_STREAM_DRAW);
+    glColorPointer(4, GL_FLOAT, sizeof(struct color), (void*)0);
+
+    glGenBuffers(1, &Object->normalvbo);
+    glBindBuffer(GL_ARRAY_BUFFER, Object->normalvbo);
+    glBufferData(GL_ARRAY_BUFFER, vertexnum * sizeof(struct vector3), normals, GL_STATIC_DRAW);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glNormalPointer(GL_FLOAT, sizeof(struct vector3), (void*)0);
+
+    // The element buffer binding is part of the VAO state
+    Object->ebo = 0;
+    if (Object->indexnum > 0) {
+        size_t indexsize = (Object->indextype == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint);
+        glGenBuffers(1, &Object->ebo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, Object->ebo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, Object->indexnum * indexsize, Object->indices, GL_STATIC_DRAW);
+    }
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+
+void UploadObject(struct object* Object) {
+    ComputeVertexWeights(Object);
+    struct vector3* normals = ComputeVertexNormals(Object);
+    UploadObjectBuffers(Object, normals);
+    free(normals);
+}
+
+
+// One side of a triangle edge, used to match triangles that share an edge
+struct EdgeRecord {
+    unsigned long long key;     // Lower position id in the high half, higher one in the low half
+    int triangle;
+    bool forward;               // True when the triangle walks the edge from the lower id to the higher
+};
+
+
+int CompareEdgeRecords(const void* a, const void* b) {
+    const struct EdgeRecord* A = (const struct EdgeRecord*)a;
+    const struct EdgeRecord* B = (const struct EdgeRecord*)b;
+    if (A->key != B->key) {
+        return A->key < B->key ? -1 : 1;
+    }
+    return A->triangle - B->triangle;
+}
+
+
+void FlipTriangle(struct Triangle* triangle) {
+    struct vertex temp = triangle->v2;
+    triangle->v2 = triangle->v3;
+    triangle->v3 = temp;
+}
+
+
+// Gives every connected piece of the mesh one consistent winding. Closed pieces are turned
+// so they wind counter clockwise seen from outside, open ones keep the winding of their first
+// triangle. Triangles with invertnormal set are flipped afterwards.
+void OrientTriangles(int trianglenum, struct Triangle* triangles) {
+    int cornernum = trianglenum * 3;
+
+    // Weld corners by position only, UVs and colors do not matter for the topology
+    int tablesize = 1;
+    while (tablesize < cornernum * 2) {
+        tablesize <<= 1;
+    }
+
+    unsigned int* table = (unsigned int*)calloc(tablesize, sizeof(unsigned int));
+    struct vector3* positions = (struct vector3*)malloc(cornernum * sizeof(struct vector3));
+    unsigned int* ids = (unsigned int*)malloc(cornernum * sizeof(unsigned int));
+    struct EdgeRecord* edges = (struct EdgeRecord*)malloc(cornernum * sizeof(struct EdgeRecord));
+    int* neighbors = (int*)malloc(cornernum * sizeof(int));
+    bool* sameway = (bool*)malloc(cornernum * sizeof(bool));
+    int* component = (int*)malloc(trianglenum * sizeof(int));
+    bool* flipped = (bool*)calloc(trianglenum, sizeof(bool));
+    int* stack = (int*)malloc(trianglenum * sizeof(int));
+    if (table == NULL || positions == NULL || ids == NULL || edges == NULL || neighbors == NULL ||
+        sameway == NULL || component == NULL || flipped == NULL || stack == NULL) {
+        printf("Memory allocation failed for mesh orientation\n");
+        exit(1);
+    }
+
+    int positionnum = 0;
+    for (int n = 0; n < cornernum; n++) {
+        struct Triangle* t = &triangles[n / 3];
+        struct vertex* v = (n % 3 == 0) ? &t->v1 : (n % 3 == 1) ? &t->v2 : &t->v3;
+        struct vector3 p = {v->x + 0.0f, v->y + 0.0f, v->z + 0.0f};
+
+        unsigned int hash = 2166136261u;
+        const unsigned char* bytes = (const unsigned char*)&p;
+        for (size_t i = 0; i < sizeof(p); i++) {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+
+        unsigned int slot = hash & (tablesize - 1);
+        while (table[slot] != 0 && memcmp(&positions[table[slot] - 1], &p, sizeof(p)) != 0) {
+            slot = (slot + 1) & (tablesize - 1);
+        }
+        if (table[slot] == 0) {
+            positions[positionnum] = p;
+            table[slot] = ++positionnum;
+        }
+        ids[n] = table[slot] - 1;
+    }
+
+    // Sort the edges so the two sides of a shared edge end up next to each other
+    for (int n = 0; n < cornernum; n++) {
+        unsigned int a = ids[n];
+        unsigned int b = ids[(n % 3 == 2) ? n - 2 : n + 1];
+        unsigned int low = a < b ? a : b;
+        unsigned int high = a < b ? b : a;
+
+        edges[n].key = ((unsigned long long)low << 32) | high;
+        edges[n].triangle = n / 3;
+        edges[n].forward = a < b;
+        neighbors[n] = -1;
+    }
+    qsort(edges, cornernum, sizeof(struct EdgeRecord), CompareEdgeRecords);
+
+    // Link triangles across edges shared by exactly two of them. Anything else is an open border
+    // (or a non-manifold edge), so the triangles touching it do not form a closed surface
+    bool* openborder = (bool*)calloc(trianglenum, sizeof(bool));
+    int* slots = (int*)calloc(trianglenum, sizeof(int));
+    if (openborder == NULL || slots == NULL) {
+        printf("Memory allocation failed for mesh orientation\n");
+        exit(1);
+    }
+
+    for (int start = 0; start < cornernum; ) {
+        int end = start + 1;
+        while (end < cornernum && edges[end].key == edges[start].key) {
+            end++;
+        }
+
+        if (end - start == 2 && edges[start].triangle != edges[start + 1].triangle) {
+            int a = edges[start].triangle, b = edges[start + 1].triangle;
+            bool same = edges[start].forward == edges[start + 1].forward;
+            neighbors[a * 3 + slots[a]] = b; sameway[a * 3 + slots[a]] = same; slots[a]++;
+            neighbors[b * 3 + slots[b]] = a; sameway[b * 3 + slots[b]] = same; slots[b]++;
+        }
+        else {
+            // Degenerate edges (both ends welded together) are ignored
+            if (edges[start].key >> 32 != (edges[start].key & 0xFFFFFFFFull)) {
+                for (int i = start; i < end; i++) {
+                    openborder[edges[i].triangle] = true;
+                }
+            }
+        }
+        start = end;
+    }
+
+    // Flood fill each piece, flipping neighbors that walk a shared edge the same way
+    for (int i = 0; i < trianglenum; i++) {
+        component[i] = -1;
+    }
+
+    int componentnum = 0;
+    for (int seed = 0; seed < trianglenum; seed++) {
+        if (component[seed] != -1) {
+            continue;
+        }
+
+        int top = 0, count = 0;
+        bool closed = true;
+        float volume = 0.0f;
+
+        stack[top++] = seed;
+        component[seed] = componentnum;
+        while (top > 0) {
+            int t = stack[--top];
+            stack[trianglenum - 1 - count++] = t;    // Remember the members at the far end of the stack
+            closed = closed && !openborder[t];
+
+            for (int k = 0; k < 3; k++) {
+                int other = neighbors[t * 3 + k];
+                if (other < 0 || component[other] != -1) {
+                    continue;
+                }
+                // Two consistently wound triangles walk their shared edge in opposite directions
+                flipped[other] = flipped[t] ^ sameway[t * 3 + k];
+                component[other] = componentnum;
+                stack[top++] = other;
+            }
+        }
+
+        // Signed volume of the piece decides which side is outside
+        for (int m = 0; m < count; m++) {
+            int t = stack[trianglenum - 1 - m];
+            struct vector3 A = {triangles[t].v1.x, triangles[t].v1.y, triangles[t].v1.z};
+            struct vector3 B = {triangles[t].v2.x, triangles[t].v2.y, triangles[t].v2.z};
+            struct vector3 C = {triangles[t].v3.x, triangles[t].v3.y, triangles[t].v3.z};
+            float v = dotProduct(A, crossProduct(B, C));
+            volume += flipped[t] ? -v : v;
+        }
+
+        bool turn = closed && volume < 0.0f;
+        for (int m = 0; m < count; m++) {
+            int t = stack[trianglenum - 1 - m];
+            flipped[t] ^= turn;
+        }
+
+        componentnum++;
+    }
+
+    for (int i = 0; i < trianglenum; i++) {
+        if (flipped[i] ^ triangles[i].invertnormal) {
+            FlipTriangle(&triangles[i]);
+        }
+    }
+
+    free(table);
+    free(positions);
+    free(ids);
+    free(edges);
+    free(neighbors);
+    free(sameway);
+    free(component);
+    free(flipped);
+    free(stack);
+    free(openborder);
+    free(slots);
+}
+
+
+struct object CreateObjectEx(int trianglenum, struct Triangle* triangles, bool indexed) {
+    struct object newObject;
+    newObject.trianglenum = trianglenum;
+    newObject.mapping = NULL;
+    newObject.mappingsize = 0;
+
+    // Work on a copy so the caller's triangles keep their winding
+    struct Triangle* oriented = (struct Triangle*)malloc(trianglenum * sizeof(struct Triangle));
+    if (oriented == NULL) {
+        printf("Memory allocation failed for triangles\n");
+        exit(1);
+    }
+    memcpy(oriented, triangles, trianglenum * sizeof(struct Triangle));
+    OrientTriangles(trianglenum, oriented);
+    triangles = oriented;
+
+    if (indexed) {
+        // Weld identical vertices into a unique vertex array plus an index buffer
+        WeldVertices(&newObject, triangles);
+    }
+    else {
+        // Old layout: three vertices per triangle, drawn in order
+        newObject.vertexnum = trianglenum * 3;
+        newObject.vertices = (struct vertex*)malloc(newObject.vertexnum * sizeof(struct vertex));
+        if (newObject.vertices == NULL) {
+            printf("Memory allocation failed for vertices\n");
+            exit(1);
+        }
+
+        for (int i = 0; i < trianglenum; i++) {
+            newObject.vertices[i * 3 + 0] = triangles[i].v1;
+            newObject.vertices[i * 3 + 1] = triangles[i].v2;
+            newObject.vertices[i * 3 + 2] = triangles[i].v3;
+        }
+
+        newObject.indexnum = 0;
+        newObject.indices = NULL;
+        newObject.indextype = 0;
+    }
+
+    ComputeFaceData(&newObject);
+    ComputeBounds(&newObject);
+
+    // Upload the mesh to the GPU once so DrawMesh can draw it with a single call
+    UploadObject(&newObject);
+
+    free(oriented);
+
+    return newObject;
+}
+
+
+struct object CreateObject(int trianglenum, struct Triangle* triangles) {
+    return CreateObjectEx(trianglenum, triangles, true);
+}
+
+
+void DeleteObject(struct object* Object) {
+    glDeleteBuffers(1, &Object->vbo);
+    glDeleteBuffers(1, &Object->ebo);
+    glDeleteBuffers(1, &Object->colorvbo);
+    glDeleteBuffers(1, &Object->normalvbo);
+    glDeleteVertexArrays(1, &Object->vao);
+    free(Object->shades);
+    if (Object->mapping != NULL) {
+        munmap(Object->mapping, Object->mappingsize);
+        Object->mapping = NULL;
+    }
+    else {
+        free(Object->vertexweights);
+        free(Object->facenormals);
+        free(Object->centroids);
+        free(Object->vertices);
+        free(Object->indices);
+    }
+
+    Object->vao = Object->vbo = Object->ebo = Object->colorvbo = Object->normalvbo = 0;
+    Object->shades = NULL;
+    Object->vertexweights = NULL;
+    Object->facenormals = NULL;
+    Object->centroids = NULL;
+    Object->vertices = NULL;
+    Object->indices = NULL;
+    Object->trianglenum = Object->vertexnum = Object->indexnum = 0;
+}
+
+
+// Wavefront OBJ loading. The file is read in OBJREADSIZE chunks and parsed in place, only
+// the unfinished last line of a chunk is moved to the front of the buffer for the next one.
+// Numbers are parsed by hand, strtof is slow and depends on the locale.
+struct ObjParser {
+    struct vector3* positions;
+    struct color* colors;           // "v x y z r g b", white when a vertex has no color
+    int positionnum, positioncapacity, colorcapacity;
+    float* texcoords;               // u, v pairs
+    int texcoordnum, texcoordcapacity;
+    struct Triangle* triangles;
+    int trianglenum, trianglecapacity;
+    int line;
+};
+
+
+// Grows an array to hold at least needed elements, doubling so appending stays linear
+void* ObjReserve(void* array, int* capacity, int needed, size_t size) {
+    if (needed <= *capacity) {
+        return array;
+    }
+
+    int grown = *capacity < 1024 ? 1024 : *capacity;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    array = realloc(array, (size_t)grown * size);
+    if (array == NULL) {
+        printf("Memory allocation failed while loading an OBJ file\n");
+        exit(1);
+    }
+    *capacity = grown;
+    return array;
+}
+
+
+const char* ObjSkipSpaces(const char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    return p;
+}
+
+
+// Parses a decimal float like -1.25e-3. The digits are gathered in an integer and scaled
+// once by a power of ten, which is exact for the 7 digits a float holds.
+bool ObjParseFloat(const char** cursor, float* value) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char* p = ObjSkipSpaces(*cursor);
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') {
+        p++;
+    }
+
+    unsigned long long mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    const char* start = p;
+
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+            digits += mantissa != 0;
+        }
+        else {
+            exponent++;
+        }
+    }
+    if (*p == '.') {
+        p++;
+        for (; *p >= '0' && *p <= '9'; p++) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
+        }
+    }
+    if (p == start || (p == start + 1 && *start == '.')) {
+        return false;
+    }
+
+    if (*p == 'e' || *p == 'E') {
+        const char* e = p + 1;
+        bool negativeexponent = *e == '-';
+        if (*e == '-' || *e == '+') {
+            e++;
+        }
+        if (*e >= '0' && *e <= '9') {
+            int power = 0;
+            for (; *e >= '0' && *e <= '9'; e++) {
+                power = power < 10000 ? power * 10 + (*e - '0') : power;
+            }
+            exponent += negativeexponent ? -power : power;
+            p = e;
+        }
+    }
+
+    double result = (double)mantissa;
+    if (exponent < 0) {
+        result = exponent >= -22 ? result / powers[-exponent] : result * pow(10.0, exponent);
+    }
+    else if (exponent > 0) {
+        result = exponent <= 22 ? result * powers[exponent] : result * pow(10.0, exponent);
+    }
+
+    *value = (float)(negative ? -result : result);
+    *cursor = p;
+    return true;
+}
+
+
+bool ObjParseInt(const char** cursor, int* value) {
+    const char* p = *cursor;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') {
+        p++;
+    }
+    if (*p < '0' || *p > '9') {
+        return false;
+    }
+
+    long long result = 0;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        result = result < 0x7FFFFFFF ? result * 10 + (*p - '0') : result;
+    }
+    *value = (int)(negative ? -result : result);
+    *cursor = p;
+    return true;
+}
+
+
+// OBJ indices start at 1, negative ones count back from the newest element
+bool ObjResolveIndex(int index, int count, int* resolved) {
+    *resolved = index > 0 ? index - 1 : count + index;
+    return index != 0 && *resolved >= 0 && *resolved < count;
+}
+
+
+// One corner of a face, "v", "v/vt", "v//vn" or "v/vt/vn". The normals are not used,
+// CreateObject computes its own.
+bool ObjParseCorner(struct ObjParser* parser, const char** cursor, struct vertex* corner) {
+    const char* p = ObjSkipSpaces(*cursor);
+    int index, position, texcoord = -1;
+    if (!ObjParseInt(&p, &index) || !ObjResolveIndex(index, parser->positionnum, &position)) {
+        return false;
+    }
+
+    if (*p == '/') {
+        p++;
+        if (*p != '/') {
+            if (!ObjParseInt(&p, &index) || !ObjResolveIndex(index, parser->texcoordnum, &texcoord)) {
+                return false;
+            }
+        }
+        if (*p == '/') {
+            p++;
+            ObjParseInt(&p, &index);
+        }
+    }
+
+    struct vector3 v = parser->positions[position];
+    struct color c = parser->colors[position];
+    *corner = (struct vertex){
+        .x = v.x, .y = v.y, .z = v.z,
+        .r = c.r, .g = c.g, .b = c.b, .a = c.a,
+        .u = texcoord >= 0 ? parser->texcoords[texcoord * 2 + 0] : 0.0f,
+        .v = texcoord >= 0 ? parser->texcoords[texcoord * 2 + 1] : 0.0f
+    };
+    *cursor = p;
+    return true;
+}
+
+
+// Parses one line that ends in a newline, returns false on a malformed statement
+bool ObjParseLine(struct ObjParser* parser, const char* p) {
+    p = ObjSkipSpaces(p);
+
+    if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+        p += 2;
+        parser->positions = (struct vector3*)ObjReserve(parser->positions, &parser->positioncapacity, parser->positionnum + 1, sizeof(struct vector3));
+        parser->colors = (struct color*)ObjReserve(parser->colors, &parser->colorcapacity, parser->positionnum + 1, sizeof(struct color));
+
+        struct vector3* v = &parser->positions[parser->positionnum];
+        struct color* c = &parser->colors[parser->positionnum];
+        if (!ObjParseFloat(&p, &v->x) || !ObjParseFloat(&p, &v->y) || !ObjParseFloat(&p, &v->z)) {
+            return false;
+        }
+        *c = WHITE;
+        if (ObjParseFloat(&p, &c->r)) {
+            if (!ObjParseFloat(&p, &c->g) || !ObjParseFloat(&p, &c->b)) {
+                // Four numbers is a weight, not a color
+                *c = WHITE;
+            }
+        }
+        parser->positionnum++;
+    }
+    else if (p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+        p += 3;
+        parser->texcoords = (float*)ObjReserve(parser->texcoords, &parser->texcoordcapacity, (parser->texcoordnum + 1) * 2, sizeof(float));
+        float* uv = &parser->texcoords[parser->texcoordnum * 2];
+        if (!ObjParseFloat(&p, &uv[0])) {
+            return false;
+        }
+        if (!ObjParseFloat(&p, &uv[1])) {
+            uv[1] = 0.0f;
+        }
+        parser->texcoordnum++;
+    }
+    else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+        p += 2;
+
+        // Polygons are split into a fan around their first corner, fine for the convex
+        // faces exporters write
+        struct vertex first, previous, current;
+        if (!ObjParseCorner(parser, &p, &first) || !ObjParseCorner(parser, &p, &previous)) {
+            return false;
+        }
+
+        // A trailing comment ends the corner list like the end of the line does
+        int corners = 2;
+        while (*(p = ObjSkipSpaces(p)) != '\n' && *p != '#') {
+            if (!ObjParseCorner(parser, &p, &current)) {
+                return false;
+            }
+            parser->triangles = (struct Triangle*)ObjReserve(parser->triangles, &parser->trianglecapacity, parser->trianglenum + 1, sizeof(struct Triangle));
+            parser->triangles[parser->trianglenum++] = (struct Triangle){first, previous, current, false};
+            previous = current;
+            corners++;
+        }
+        if (corners < 3) {
+            return false;
+        }
+    }
+
+    // Comments, normals, groups, materials and everything else are skipped
+    return true;
+}
+
+
+// Loads every face of an OBJ file into one object, false when the file can not be read
+bool LoadOBJ(const char* filename, struct object* Object) {
+    long long start = MonotonicNanoseconds();
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        printf("Error opening OBJ file: %s\n", filename);
+        return false;
+    }
+
+    // One byte extra for the newline that ends a last line without one
+    char* buffer = (char*)malloc(OBJREADSIZE + 1);
+    if (buffer == NULL) {
+        printf("Memory allocation failed while loading an OBJ file\n");
+        exit(1);
+    }
+
+    struct ObjParser parser = {0};
+    bool valid = true;
+    size_t carried = 0;
+    long long bytes = 0;
+
+    while (valid) {
+        size_t read = fread(buffer + carried, 1, OBJREADSIZE - carried, file);
+        bytes += read;
+        size_t filled = carried + read;
+        bool last = read == 0 || feof(file);
+        if (filled == 0) {
+            break;
+        }
+        if (last && buffer[filled - 1] != '\n') {
+            buffer[filled++] = '\n';
+        }
+
+        char* line = buffer;
+        char* end = buffer + filled;
+        char* newline;
+        while ((newline = (char*)memchr(line, '\n', end - line)) != NULL) {
+            parser.line++;
+            if (!ObjParseLine(&parser, line)) {
+                printf("Malformed statement on line %d of %s\n", parser.line, filename);
+                valid = false;
+                break;
+            }
+            line = newline + 1;
+        }
+
+        // Keep the unfinished line for the next read
+        carried = end - line;
+        if (carried == OBJREADSIZE) {
+            printf("Line %d of %s is longer than %d bytes\n", parser.line + 1, filename, OBJREADSIZE);
+            valid = false;
+        }
+        memmove(buffer, line, carried);
+        if (last) {
+            break;
+        }
+    }
+
+    fclose(file);
+    free(buffer);
+
+    if (valid && parser.trianglenum == 0) {
+        printf("OBJ file %s has no faces\n", filename);
+        valid = false;
+    }
+    if (valid) {
+        double parseseconds = (MonotonicNanoseconds() - start) / 1e9;
+        *Object = CreateObject(parser.trianglenum, parser.triangles);
+        printf("OBJ file %s loaded successfully: %d triangles, parsed %.1f MB in %.1f ms (%.0f MB/s), %.1f ms total\n",
+               filename, parser.trianglenum, bytes / 1e6, parseseconds * 1e3, bytes / 1e6 / parseseconds,
+               (MonotonicNanoseconds() - start) / 1e6);
+    }
+
+    free(parser.positions);
+    free(parser.colors);
+    free(parser.texcoords);
+    free(parser.triangles);
+    return valid;
+}
+
+
+// Binary mesh cache. Everything CreateObject computes is written to <source>.cmesh, with the
+// vertex, index and normal sections laid out exactly like the GPU buffers. Loading maps the
+// file and uploads straight from the mapping, the CPU side arrays of the object keep pointing
+// into it. The header holds a hash of the source file, a changed source rebuilds the cache.
+#define MESHCACHEMAGIC "CALMESH"
+#define MESHCACHEALIGN 64
+
+enum MeshCacheSection {
+    MESHSECTION_VERTICES,       // struct vertex, the static VBO
+    MESHSECTION_INDICES,        // GLushort or GLuint, the EBO
+    MESHSECTION_NORMALS,        // struct vector3 per vertex, the normal VBO
+    MESHSECTION_WEIGHTS,        // float per vertex
+    MESHSECTION_FACENORMALS,    // struct vector3 per triangle
+    MESHSECTION_CENTROIDS,      // struct vector3 per triangle
+    MESHSECTIONS
+};
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;         // 0x01020304 as written, a cache from another byte order does not match
+    uint32_t vertexsize;        // sizeof(struct vertex), catches a changed vertex layout
+    uint32_t indextype;
+    int32_t trianglenum;
+    int32_t vertexnum;
+    int32_t indexnum;
+    uint32_t padding;
+    uint64_t sourcesize;
+    uint64_t sourcehash;
+    float boundsmin[3], boundsmax[3], boundcenter[3];
+    float boundradius;
+    uint64_t offsets[MESHSECTIONS];
+    uint64_t sizes[MESHSECTIONS];
+};
+
+
+// 64 bit FNV style hash over 8 bytes at a time, fast enough to check every source on load
+uint64_t HashBytes(const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hash = 14695981039346656037ull ^ size;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, size - i);
+    hash = (hash ^ tail) * 1099511628211ull;
+    return hash ^ (hash >> 29);
+}
+
+
+// Size and hash of a source file, read through a mapping so nothing is copied
+bool HashFile(const char* path, uint64_t* size, uint64_t* hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+
+    *size = (uint64_t)info.st_size;
+    if (info.st_size == 0) {
+        *hash = HashBytes("", 0);
+        close(fd);
+        return true;
+    }
+
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+    *hash = HashBytes(data, info.st_size);
+    munmap(data, info.st_size);
+    return true;
+}
+
+
+// Maps a cache and builds the object from it, false when it is missing, damaged or stale
+bool LoadMeshCache(const char* cachepath, uint64_t sourcesize, uint64_t sourcehash, struct object* Object) {
+    int fd = open(cachepath, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(struct MeshCacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = info.st_size;
+    // Private and writable, so a texture atlas can remap the texture coordinates in place
+    // without touching the file
+    unsigned char* data = (unsigned char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == (unsigned char*)MAP_FAILED) {
+        return false;
+    }
+
+    const struct MeshCacheHeader* header = (const struct MeshCacheHeader*)data;
+    bool valid = memcmp(header->magic, MESHCACHEMAGIC, sizeof(MESHCACHEMAGIC)) == 0 &&
+                 header->version == MESHCACHEVERSION && header->byteorder == 0x01020304 &&
+                 header->vertexsize == sizeof(struct vertex) &&
+                 header->sourcesize == sourcesize && header->sourcehash == sourcehash &&
+                 header->trianglenum > 0 && header->vertexnum > 0;
+
+    // The index type goes straight to glDrawElements, anything but the two CreateObject writes
+    // is a damaged file. Only a mesh without indices has no type at all.
+    bool indexed = header->indextype == GL_UNSIGNED_SHORT || header->indextype == GL_UNSIGNED_INT;
+    valid = valid && (indexed || (header->indexnum == 0 && header->indextype == 0));
+    size_t indexsize = header->indextype == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+
+    // Everything that draws or lights the mesh walks trianglenum * 3 corners, through the indices
+    // or straight through the vertices
+    int64_t corners = (int64_t)header->trianglenum * 3;
+    valid = valid && (indexed ? header->indexnum == corners : header->vertexnum == corners);
+
+    // Every section has to be inside the file and as big as the counts say
+    uint64_t expected[MESHSECTIONS] = {
+        (uint64_t)header->vertexnum * sizeof(struct vertex),
+        (uint64_t)header->indexnum * indexsize,
+        (uint64_t)header->vertexnum * sizeof(struct vector3),
+        (uint64_t)header->vertexnum * sizeof(float),
+        (uint64_t)header->trianglenum * sizeof(struct vector3),
+        (uint64_t)header->trianglenum * sizeof(struct vector3)
+    };
+    for (int i = 0; i < MESHSECTIONS && valid; i++) {
+        valid = header->sizes[i] == expected[i] && header->offsets[i] % MESHCACHEALIGN == 0 &&
+                header->offsets[i] <= size && header->sizes[i] <= size - header->offsets[i];
+    }
+
+    // And every corner has to name a vertex that exists, one pass is cheap next to the upload
+    const unsigned char* indices = data + header->offsets[MESHSECTION_INDICES];
+    for (int i = 0; i < header->indexnum && valid; i++) {
+        uint32_t index = header->indextype == GL_UNSIGNED_SHORT ? ((const GLushort*)indices)[i] : ((const GLuint*)indices)[i];
+        valid = index < (uint32_t)header->vertexnum;
+    }
+    if (!valid) {
+        munmap(data, size);
+        return false;
+    }
+
+    // The GPU copy is made from the mapping, the pages are read in as the driver walks them
+    madvise(data, size, MADV_WILLNEED);
+
+    *Object = (struct object){0};
+    Object->trianglenum = header->trianglenum;
+    Object->vertexnum = header->vertexnum;
+    Object->indexnum = header->indexnum;
+    Object->indextype = header->indextype;
+    Object->vertices = (struct vertex*)(data + header->offsets[MESHSECTION_VERTICES]);
+    Object->indices = header->indexnum > 0 ? data + header->offsets[MESHSECTION_INDICES] : NULL;
+    Object->vertexweights = (float*)(data + header->offsets[MESHSECTION_WEIGHTS]);
+    Object->facenormals = (struct vector3*)(data + header->offsets[MESHSECTION_FACENORMALS]);
+    Object->centroids = (struct vector3*)(data + header->offsets[MESHSECTION_CENTROIDS]);
+    Object->boundsmin = (struct vector3){header->boundsmin[0], header->boundsmin[1], header->boundsmin[2]};
+    Object->boundsmax = (struct vector3){header->boundsmax[0], header->boundsmax[1], header->boundsmax[2]};
+    Object->boundcenter = (struct vector3){header->boundcenter[0], header->boundcenter[1], header->boundcenter[2]};
+    Object->boundradius = header->boundradius;
+    Object->mapping = data;
+    Object->mappingsize = size;
+
+    UploadObjectBuffers(Object, (const struct vector3*)(data + header->offsets[MESHSECTION_NORMALS]));
+    return true;
+}
+
+
+// Writes the cache under a temporary name and renames it, so a reader never sees half a file
+bool WriteMeshCache(const char* cachepath, const struct object* Object, uint64_t sourcesize, uint64_t sourcehash) {
+    struct vector3* normals = ComputeVertexNormals(Object);
+    size_t indexsize = Object->indextype == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+
+    const void* sections[MESHSECTIONS] = {
+        Object->vertices, Object->indices, normals,
+        Object->vertexweights, Object->facenormals, Object->centroids
+    };
+
+    struct MeshCacheHeader header = {0};
+    memcpy(header.magic, MESHCACHEMAGIC, sizeof(MESHCACHEMAGIC));
+    header.version = MESHCACHEVERSION;
+    header.byteorder = 0x01020304;
+    header.vertexsize = sizeof(struct vertex);
+    header.indextype = Object->indextype;
+    header.trianglenum = Object->trianglenum;
+    header.vertexnum = Object->vertexnum;
+    header.indexnum = Object->indexnum;
+    header.sourcesize = sourcesize;
+    header.sourcehash = sourcehash;
+    memcpy(header.boundsmin, &Object->boundsmin, sizeof(header.boundsmin));
+    memcpy(header.boundsmax, &Object->boundsmax, sizeof(header.boundsmax));
+    memcpy(header.boundcenter, &Object->boundcenter, sizeof(header.boundcenter));
+    header.boundradius = Object->boundradius;
+
+    header.sizes[MESHSECTION_VERTICES] = (uint64_t)Object->vertexnum * sizeof(struct vertex);
+    header.sizes[MESHSECTION_INDICES] = (uint64_t)Object->indexnum * indexsize;
+    header.sizes[MESHSECTION_NORMALS] = (uint64_t)Object->vertexnum * sizeof(struct vector3);
+    header.sizes[MESHSECTION_WEIGHTS] = (uint64_t)Object->vertexnum * sizeof(float);
+    header.sizes[MESHSECTION_FACENORMALS] = (uint64_t)Object->trianglenum * sizeof(struct vector3);
+    header.sizes[MESHSECTION_CENTROIDS] = (uint64_t)Object->trianglenum * sizeof(struct vector3);
+
+    // Sections start on cache line boundaries so the mapping can be handed to GL as is
+    uint64_t offset = sizeof(struct MeshCacheHeader);
+    for (int i = 0; i < MESHSECTIONS; i++) {
+        offset = (offset + MESHCACHEALIGN - 1) / MESHCACHEALIGN * MESHCACHEALIGN;
+        header.offsets[i] = offset;
+        offset += header.sizes[i];
+    }
+
+    char temppath[1024];
+    snprintf(temppath, sizeof(temppath), "%s.%d.tmp", cachepath, (int)getpid());
+    FILE* file = fopen(temppath, "wb");
+    if (file == NULL) {
+        printf("Error opening %s for the mesh cache\n", temppath);
+        free(normals);
+        return false;
+    }
+
+    static const unsigned char zeros[MESHCACHEALIGN] = {0};
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t position = sizeof(header);
+    for (int i = 0; i < MESHSECTIONS && written; i++) {
+        written = fwrite(zeros, 1, header.offsets[i] - position, file) == header.offsets[i] - position &&
+                  (header.sizes[i] == 0 || fwrite(sections[i], header.sizes[i], 1, file) == 1);
+        position = header.offsets[i] + header.sizes[i];
+    }
+    written = fclose(file) == 0 && written;
+    free(normals);
+
+    if (!written || rename(temppath, cachepath) != 0) {
+        printf("Error writing the mesh cache %s\n", cachepath);
+        remove(temppath);
+        return false;
+    }
+    return true;
+}
+
+
+// Loads a mesh from its cache when that is current, otherwise parses the source and
+// writes a new cache for the next start
+bool LoadMesh(const char* path, struct object* Object) {
+    uint64_t sourcesize, sourcehash;
+    if (!MESHCACHE || !HashFile(path, &sourcesize, &sourcehash)) {
+        return LoadOBJ(path, Object);
+    }
+
+    char cachepath[1024];
+    snprintf(cachepath, sizeof(cachepath), "%s.cmesh", path);
+
+    long long start = MonotonicNanoseconds();
+    if (LoadMeshCache(cachepath, sourcesize, sourcehash, Object)) {
+        printf("Mesh %s loaded from its cache: %d triangles in %.1f ms\n", path, Object->trianglenum,
+               (MonotonicNanoseconds() - start) / 1e6);
+        return true;
+    }
+
+    if (!LoadOBJ(path, Object)) {
+        return false;
+    }
+    if (WriteMeshCache(cachepath, Object, sourcesize, sourcehash)) {
+        printf("Mesh cache %s written\n", cachepath);
+    }
+    return true;
+}
+
+
+// GL state cache, so redundant texture and program binds never reach the driver
+struct BindStats {
+    int texturebinds;
+    int programbinds;
+    int skippedtexturebinds;
+    int skippedprogrambinds;
+};
+
+struct BindStats BINDSTATS = {0};
+GLuint BoundTexture = 0;
+GLuint BoundTextureArray = 0;
+GLuint BoundProgram = 0;
+
+
+void BindTexture(GLuint TextureID) {
+    if (TextureID == BoundTexture) {
+        BINDSTATS.skippedtexturebinds++;
+        return;
+    }
+    glBindTexture(GL_TEXTURE_2D, TextureID);
+    BoundTexture = TextureID;
+    BINDSTATS.texturebinds++;
+}
+
+
+// Array textures have their own binding point next to GL_TEXTURE_2D on the same unit
+void BindTextureArray(GLuint TextureID) {
+    if (TextureID == BoundTextureArray) {
+        BINDSTATS.skippedtexturebinds++;
+        return;
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, TextureID);
+    BoundTextureArray = TextureID;
+    BINDSTATS.texturebinds++;
+}
+
+
+void UseProgram(GLuint program) {
+    if (program == BoundProgram) {
+        BINDSTATS.skippedprogrambinds++;
+        return;
+    }
+    glUseProgram(program);
+    BoundProgram = program;
+    BINDSTATS.programbinds++;
+}
+
+
+// Filtering and wrapping of every texture loaded from a file
+void SetTextureParameters() {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+
+// Makes a texture from decoded pixels, the caller still owns the pixels
+GLuint CreateTexture(const unsigned char* pixels, int width, int height, GLenum format) {
+    // Generate the OpenGL texture ID
+    GLuint textureID;
+    glGenTextures(1, &textureID);
+    BindTexture(textureID);
+
+    // Set texture parameters (e.g., filtering, wrapping)
+    SetTextureParameters();
+
+    // Load the texture data into OpenGL
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, pixels);
+    glGenerateMipmap(GL_TEXTURE_2D); // Optionally generate mipmaps
+
+    // Return the texture ID
+    return textureID;
+}
+
+
+GLuint LoadTexture(const char* filename) {
+    // Load the image data using stb_image
+    int width, height, channels;
+    stbi_set_flip_vertically_on_load(1);
+    unsigned char* img_data = stbi_load(filename, &width, &height, &channels, 0);
+    if (img_data == NULL) {
+        printf("Error in loading texture image: %s\n", filename);
+        return 0; // Return 0 if there's an error
+    }
+
+    GLenum format = GL_RGB;
+    if (channels == 4) {
+        format = GL_RGBA; // If the image has an alpha channel
+    }
+    GLuint textureID = CreateTexture(img_data, width, height, format);
+
+    // Free the image data as it's now loaded into OpenGL
+    stbi_image_free(img_data);
+    return textureID;
+}
+
+
+// Asynchronous texture loading. LoadTextureAsync hands back a texture name right away that
+// shows a grey placeholder texel. Worker threads read and decode the file, then the GL
+// thread copies the pixels into a pixel buffer object and respecifies the same texture from
+// it, so everything already using the name switches over by itself. The GL thread only ever
+// tries the lock, it never waits for a worker, the disk or the PNG decoder.
+struct TextureRequest {
+    char* filename;
+    GLuint texture;
+    unsigned char* pixels;          // RGBA, NULL when decoding failed
+    int width, height;
+    uint64_t contenthash;           // HashBytes of the file, 0 when it could not be read
+    struct TextureRequest* next;
+};
+
+struct TextureLoader {
+    pthread_t threads[TEXTURETHREADS];
+    int threadcount;
+    bool running;                   // Guarded by lock
+
+    // Both lists are first in first out and guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    struct TextureRequest* queue;
+    struct TextureRequest* queuetail;
+    struct TextureRequest* decoded;
+    struct TextureRequest* decodedtail;
+
+    int pending;                    // Requested and not uploaded yet, only used by the GL thread
+    GLuint pbo;
+};
+
+struct TextureLoader textureloader = {.lock = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER};
+
+
+// Maps an image file once to hash it and decode it to RGBA. Returns NULL when the file cannot
+// be read or decoded, size and hash are 0 when it cannot be read.
+unsigned char* LoadImageFile(const char* path, int* width, int* height, uint64_t* size, uint64_t* hash) {
+    unsigned char* pixels = NULL;
+    *size = 0;
+    *hash = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            int channels;
+            *size = (uint64_t)info.st_size;
+            *hash = HashBytes(data, info.st_size);
+            pixels = stbi_load_from_memory((const stbi_uc*)data, (int)info.st_size, width, height, &channels, 4);
+            munmap(data, info.st_size);
+        }
+    }
+    close(fd);
+    return pixels;
+}
+
+
+void* TextureLoaderThread(void* unused) {
+    (void)unused;
+
+    // The flip setting of stb_image is global, this thread gets its own
+    stbi_set_flip_vertically_on_load_thread(1);
+
+    pthread_mutex_lock(&textureloader.lock);
+    while (true) {
+        while (textureloader.running && textureloader.queue == NULL) {
+            pthread_cond_wait(&textureloader.wakeup, &textureloader.lock);
+        }
+        if (!textureloader.running) {
+            break;
+        }
+
+        struct TextureRequest* request = textureloader.queue;
+        textureloader.queue = request->next;
+        if (textureloader.queue == NULL) {
+            textureloader.queuetail = NULL;
+        }
+        pthread_mutex_unlock(&textureloader.lock);
+
+        // Always four channels, so any width uploads without row padding
+        uint64_t size;
+        request->pixels = LoadImageFile(request->filename, &request->width, &request->height, &size, &request->contenthash);
+        request->next = NULL;
+
+        pthread_mutex_lock(&textureloader.lock);
+        if (textureloader.decodedtail != NULL) {
+            textureloader.decodedtail->next = request;
+        }
+        else {
+            textureloader.decoded = request;
+        }
+        textureloader.decodedtail = request;
+    }
+    pthread_mutex_unlock(&textureloader.lock);
+
+    return NULL;
+}
+
+
+void InitTextureLoader() {
+    glGenBuffers(1, &textureloader.pbo);
+
+    textureloader.running = true;
+    for (int i = 0; i < TEXTURETHREADS; i++) {
+        if (pthread_create(&textureloader.threads[i], NULL, TextureLoaderThread, NULL) != 0) {
+            break;
+        }
+        textureloader.threadcount++;
+    }
+    if (textureloader.threadcount == 0) {
+        printf("Could not start a texture loading thread, textures load synchronously\n");
+        textureloader.running = false;
+    }
+}
+
+
+bool TextureLoadFinished(GLuint texture, bool decoded, uint64_t contenthash);
+
+
+// Streams the decoded pixels through the PBO into the texture and frees the request
+void UploadTextureRequest(struct TextureRequest* request) {
+    textureloader.pending--;
+
+    // The registry drops textures that were released before their pixels arrived
+    if (!TextureLoadFinished(request->texture, request->pixels != NULL, request->contenthash)) {
+        stbi_image_free(request->pixels);
+        free(request->filename);
+        free(request);
+        return;
+    }
+
+    if (request->pixels == NULL) {
+        printf("Error in loading texture image: %s, keeping the placeholder\n", request->filename);
+        free(request->filename);
+        free(request);
+        return;
+    }
+
+    size_t size = (size_t)request->width * request->height * 4;
+    BindTexture(request->texture);
+
+    // Orphan the buffer so the driver never waits for the previous upload to finish reading it
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, textureloader.pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    void* staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (staging != NULL) {
+        memcpy(staging, request->pixels, size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, request->width, request->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    else {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, request->width, request->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, request->pixels);
+    }
+    glGenerateMipmap(GL_TEXTURE_2D);
+
+    printf("Texture %s loaded successfully. ID: %u\n", request->filename, request->texture);
+    stbi_image_free(request->pixels);
+    free(request->filename);
+    free(request);
+}
+
+
+// Uploads decoded textures, up to TEXTUREUPLOADBUDGET bytes a call. Call once per frame
+// on the GL thread. When wait is set it blocks until the decoded list can be taken.
+void UploadDecodedTextures(bool wait) {
+    if (textureloader.pending == 0) {
+        return;
+    }
+
+    if (wait) {
+        pthread_mutex_lock(&textureloader.lock);
+    }
+    else if (pthread_mutex_trylock(&textureloader.lock) != 0) {
+        return;
+    }
+    struct TextureRequest* decoded = textureloader.decoded;
+    textureloader.decoded = NULL;
+    textureloader.decodedtail = NULL;
+    pthread_mutex_unlock(&textureloader.lock);
+
+    size_t uploaded = 0;
+    while (decoded != NULL && (wait || uploaded < TEXTUREUPLOADBUDGET)) {
+        struct TextureRequest* request = decoded;
+        decoded = request->next;
+        uploaded += (size_t)request->width * request->height * 4;
+        UploadTextureRequest(request);
+    }
+
+    // Whatever is over budget goes back to the front for the next frame
+    if (decoded != NULL) {
+        struct TextureRequest* last = decoded;
+        while (last->next != NULL) {
+            last = last->next;
+        }
+        pthread_mutex_lock(&textureloader.lock);
+        last->next = textureloader.decoded;
+        if (textureloader.decoded == NULL) {
+            textureloader.decodedtail = last;
+        }
+        textureloader.decoded = decoded;
+        pthread_mutex_unlock(&textureloader.lock);
+    }
+}
+
+
+// Blocks until every requested texture is uploaded, for runs that must render the same
+// frames every time
+void FinishTextureLoads() {
+    while (textureloader.pending > 0) {
+        UploadDecodedTextures(true);
+        if (textureloader.pending > 0) {
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+
+// Returns a texture at once, it shows a grey texel until the file is decoded and uploaded
+GLuint LoadTextureAsync(const char* filename) {
+    if (!textureloader.running) {
+        return LoadTexture(filename);
+    }
+
+    struct TextureRequest* request = (struct TextureRequest*)calloc(1, sizeof(struct TextureRequest));
+    char* name = strdup(filename);
+    if (request == NULL || name == NULL) {
+        printf("Memory allocation failed for a texture request\n");
+        exit(1);
+    }
+    request->filename = name;
+
+    static const unsigned char placeholder[4] = {128, 128, 128, 255};
+    glGenTextures(1, &request->texture);
+    BindTexture(request->texture);
+    SetTextureParameters();
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+
+    GLuint texture = request->texture;
+    textureloader.pending++;
+
+    pthread_mutex_lock(&textureloader.lock);
+    if (textureloader.queuetail != NULL) {
+        textureloader.queuetail->next = request;
+    }
+    else {
+        textureloader.queue = request;
+    }
+    textureloader.queuetail = request;
+    pthread_cond_signal(&textureloader.wakeup);
+    pthread_mutex_unlock(&textureloader.lock);
+
+    return texture;
+}
+
+
+// Stops the workers, textures that were still loading keep their placeholder
+void FreeTextureLoader() {
+    pthread_mutex_lock(&textureloader.lock);
+    textureloader.running = false;
+    pthread_cond_broadcast(&textureloader.wakeup);
+    pthread_mutex_unlock(&textureloader.lock);
+
+    for (int i = 0; i < textureloader.threadcount; i++) {
+        pthread_join(textureloader.threads[i], NULL);
+    }
+
+    struct TextureRequest* lists[2] = {textureloader.queue, textureloader.decoded};
+    for (int i = 0; i < 2; i++) {
+        while (lists[i] != NULL) {
+            struct TextureRequest* next = lists[i]->next;
+            stbi_image_free(lists[i]->pixels);
+            free(lists[i]->filename);
+            free(lists[i]);
+            lists[i] = next;
+        }
+    }
+
+    if (textureloader.pbo != 0) {
+        glDeleteBuffers(1, &textureloader.pbo);
+    }
+    textureloader = (struct TextureLoader){.lock = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER};
+}
+
+
+// Texture registry. Materials ask for textures by path thousands of times, the registry
+// loads each file once and counts the references to the texture name it handed out.
+// Paths are looked up in a hash table. Once a file is read its content hash goes into a
+// second table, so the same image under another path (a copy, a symlink, ../ in the path)
+// shares the texture from then on. Every texture gets deleted when its last reference is
+// released, or by FreeTextureRegistry in ascending name order, whatever is left over.
+struct TexturePath;
+
+struct TextureRecord {
+    GLuint texture;
+    int refcount;
+    bool loading;                   // The pixels are still on their way from the loader
+    bool hashed;                    // In the content table
+    uint64_t contenthash;
+    struct TexturePath* paths;      // Paths that resolve to this texture
+    struct TextureRecord* next;     // Content table bucket
+};
+
+struct TexturePath {
+    char* path;
+    uint64_t hash;
+    struct TextureRecord* record;
+    struct TexturePath* next;       // Path table bucket
+    struct TexturePath* nextpath;   // Next path of the same record
+};
+
+struct TextureRegistry {
+    // Both tables have the same power of two amount of buckets
+    struct TexturePath** paths;
+    struct TextureRecord** contents;
+    int buckets;
+    int pathcount;
+
+    // Texture names are small integers, so records are indexed by name directly
+    struct TextureRecord** records;
+    GLuint recordcapacity;
+};
+
+struct TextureRegistry textureregistry = {0};
+
+
+struct TexturePath* FindTexturePath(const char* path, uint64_t hash) {
+    if (textureregistry.buckets == 0) {
+        return NULL;
+    }
+    struct TexturePath* entry = textureregistry.paths[hash & (textureregistry.buckets - 1)];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+
+struct TextureRecord* FindTextureContent(uint64_t contenthash) {
+    if (textureregistry.buckets == 0) {
+        return NULL;
+    }
+    struct TextureRecord* record = textureregistry.contents[contenthash & (textureregistry.buckets - 1)];
+    while (record != NULL && record->contenthash != contenthash) {
+        record = record->next;
+    }
+    return record;
+}
+
+
+struct TextureRecord* FindTextureRecord(GLuint texture) {
+    return texture < textureregistry.recordcapacity ? textureregistry.records[texture] : NULL;
+}
+
+
+// Doubles the buckets of both tables once there are more paths than buckets
+void GrowTextureRegistry() {
+    if (textureregistry.pathcount < textureregistry.buckets) {
+        return;
+    }
+
+    int buckets = textureregistry.buckets == 0 ? 64 : textureregistry.buckets * 2;
+    struct TexturePath** paths = (struct TexturePath**)calloc(buckets, sizeof(struct TexturePath*));
+    struct TextureRecord** contents = (struct TextureRecord**)calloc(buckets, sizeof(struct TextureRecord*));
+    if (paths == NULL || contents == NULL) {
+        printf("Memory allocation failed for the texture registry\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < textureregistry.buckets; i++) {
+        while (textureregistry.paths[i] != NULL) {
+            struct TexturePath* entry = textureregistry.paths[i];
+            textureregistry.paths[i] = entry->next;
+            entry->next = paths[entry->hash & (buckets - 1)];
+            paths[entry->hash & (buckets - 1)] = entry;
+        }
+        while (textureregistry.contents[i] != NULL) {
+            struct TextureRecord* record = textureregistry.contents[i];
+            textureregistry.contents[i] = record->next;
+            record->next = contents[record->contenthash & (buckets - 1)];
+            contents[record->contenthash & (buckets - 1)] = record;
+        }
+    }
+
+    free(textureregistry.paths);
+    free(textureregistry.contents);
+    textureregistry.paths = paths;
+    textureregistry.contents = contents;
+    textureregistry.buckets = buckets;
+}
+
+
+void AddTexturePath(struct TextureRecord* record, const char* path, uint64_t hash) {
+    GrowTextureRegistry();
+
+    struct TexturePath* entry = (struct TexturePath*)malloc(sizeof(struct TexturePath));
+    char* copy = strdup(path);
+    if (entry == NULL || copy == NULL) {
+        printf("Memory allocation failed for the texture registry\n");
+        exit(1);
+    }
+    *entry = (struct TexturePath){.path = copy, .hash = hash, .record = record, .nextpath = record->paths};
+    record->paths = entry;
+
+    struct TexturePath** bucket = &textureregistry.paths[hash & (textureregistry.buckets - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    textureregistry.pathcount++;
+}
+
+
+void AddTextureContent(struct TextureRecord* record, uint64_t contenthash) {
+    record->contenthash = contenthash;
+    record->hashed = true;
+    struct TextureRecord** bucket = &textureregistry.contents[contenthash & (textureregistry.buckets - 1)];
+    record->next = *bucket;
+    *bucket = record;
+}
+
+
+struct TextureRecord* AddTextureRecord(GLuint texture) {
+    if (texture >= textureregistry.recordcapacity) {
+        GLuint capacity = textureregistry.recordcapacity == 0 ? 64 : textureregistry.recordcapacity;
+        while (capacity <= texture) {
+            capacity *= 2;
+        }
+        struct TextureRecord** records = (struct TextureRecord**)realloc(textureregistry.records, capacity * sizeof(struct TextureRecord*));
+        if (records == NULL) {
+            printf("Memory allocation failed for the texture registry\n");
+            exit(1);
+        }
+        memset(records + textureregistry.recordcapacity, 0, (capacity - textureregistry.recordcapacity) * sizeof(struct TextureRecord*));
+        textureregistry.records = records;
+        textureregistry.recordcapacity = capacity;
+    }
+
+    struct TextureRecord* record = (struct TextureRecord*)calloc(1, sizeof(struct TextureRecord));
+    if (record == NULL) {
+        printf("Memory allocation failed for the texture registry\n");
+        exit(1);
+    }
+    record->texture = texture;
+    textureregistry.records[texture] = record;
+    return record;
+}
+
+
+// Unlinks the paths of a record from the path table, the next request for them loads the file again
+void ForgetTexturePaths(struct TextureRecord* record) {
+    while (record->paths != NULL) {
+        struct TexturePath* entry = record->paths;
+        record->paths = entry->nextpath;
+
+        struct TexturePath** link = &textureregistry.paths[entry->hash & (textureregistry.buckets - 1)];
+        while (*link != entry) {
+            link = &(*link)->next;
+        }
+        *link = entry->next;
+        textureregistry.pathcount--;
+
+        free(entry->path);
+        free(entry);
+    }
+}
+
+
+// Unlinks a record and its paths from the tables and deletes its texture
+void FreeTextureRecord(struct TextureRecord* record) {
+    ForgetTexturePaths(record);
+
+    if (record->hashed) {
+        struct TextureRecord** link = &textureregistry.contents[record->contenthash & (textureregistry.buckets - 1)];
+        while (*link != record) {
+            link = &(*link)->next;
+        }
+        *link = record->next;
+    }
+
+    textureregistry.records[record->texture] = NULL;
+    glDeleteTextures(1, &record->texture);
+    free(record);
+}
+
+
+// Without the loader threads the file is mapped once, hashed and, unless the same image is
+// already registered, decoded from the same mapping
+GLuint AcquireTextureNow(const char* path, uint64_t hash) {
+    void* data = MAP_FAILED;
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+    }
+    if (data == MAP_FAILED) {
+        printf("Error in loading texture image: %s\n", path);
+        return 0;
+    }
+
+    uint64_t contenthash = HashBytes(data, info.st_size);
+    struct TextureRecord* record = FindTextureContent(contenthash);
+    if (record != NULL) {
+        AddTexturePath(record, path, hash);
+        record->refcount++;
+        munmap(data, info.st_size);
+        return record->texture;
+    }
+
+    int width, height, channels;
+    stbi_set_flip_vertically_on_load(1);
+    unsigned char* pixels = stbi_load_from_memory((const stbi_uc*)data, (int)info.st_size, &width, &height, &channels, 4);
+    munmap(data, info.st_size);
+    if (pixels == NULL) {
+        printf("Error in loading texture image: %s\n", path);
+        return 0;
+    }
+
+    GLuint texture = CreateTexture(pixels, width, height, GL_RGBA);
+    stbi_image_free(pixels);
+
+    record = AddTextureRecord(texture);
+    record->refcount = 1;
+    AddTexturePath(record, path, hash);
+    AddTextureContent(record, contenthash);
+    return texture;
+}
+
+
+// Returns the texture for a path with one more reference, loading it the first time.
+// Every call that returns a texture needs a ReleaseTexture. With the loader threads running
+// that is every call: the texture shows a grey placeholder until its pixels arrive, and a
+// file that fails to decode keeps the placeholder for the references already handed out
+// while its path is forgotten, so a later call tries the file again. Without the threads
+// the file is loaded right here and 0 is returned when it cannot be.
+GLuint AcquireTexture(const char* path) {
+    uint64_t hash = HashBytes(path, strlen(path));
+    struct TexturePath* entry = FindTexturePath(path, hash);
+    if (entry != NULL) {
+        entry->record->refcount++;
+        return entry->record->texture;
+    }
+
+    if (!textureloader.running) {
+        return AcquireTextureNow(path, hash);
+    }
+
+    GLuint texture = LoadTextureAsync(path);
+    struct TextureRecord* record = AddTextureRecord(texture);
+    record->refcount = 1;
+    record->loading = true;
+    AddTexturePath(record, path, hash);
+    return texture;
+}
+
+
+// Puts a texture made elsewhere, like an atlas page, in the registry under a name with one reference
+void RegisterTexture(GLuint texture, const char* name) {
+    struct TextureRecord* record = AddTextureRecord(texture);
+    record->refcount = 1;
+    AddTexturePath(record, name, HashBytes(name, strlen(name)));
+}
+
+
+// One more reference to a registered texture, released like any other
+GLuint RetainTexture(GLuint texture) {
+    struct TextureRecord* record = FindTextureRecord(texture);
+    if (record == NULL) {
+        printf("Warning: texture %u is not registered\n", texture);
+        return texture;
+    }
+    record->refcount++;
+    return texture;
+}
+
+
+// Drops one reference, the texture is deleted with the last one. A texture that is still
+// loading stays registered until its pixels arrive, so asking for it again in between
+// does not read the file twice.
+void ReleaseTexture(GLuint texture) {
+    struct TextureRecord* record = FindTextureRecord(texture);
+    if (record == NULL || record->refcount == 0) {
+        printf("Warning: releasing texture %u which holds no references\n", texture);
+        return;
+    }
+
+    record->refcount--;
+    if (record->refcount == 0 && !record->loading) {
+        FreeTextureRecord(record);
+    }
+}
+
+
+// Called by the GL thread when the loader is done with a texture, before the upload.
+// Returns false when nobody holds the texture anymore and the pixels can be thrown away.
+bool TextureLoadFinished(GLuint texture, bool decoded, uint64_t contenthash) {
+    struct TextureRecord* record = FindTextureRecord(texture);
+    if (record == NULL) {
+        // Not loaded through the registry
+        return true;
+    }
+
+    record->loading = false;
+    if (record->refcount == 0) {
+        FreeTextureRecord(record);
+        return false;
+    }
+    if (!decoded) {
+        ForgetTexturePaths(record);
+        return true;
+    }
+
+    // The same image was already loaded under another path. The references handed out so far
+    // keep this texture, further requests for these paths get the existing one instead.
+    struct TextureRecord* original = FindTextureContent(contenthash);
+    if (original == NULL) {
+        AddTextureContent(record, contenthash);
+        return true;
+    }
+
+    printf("Texture %s has the same contents as %s, sharing ID %u\n", record->paths->path, original->paths->path, original->texture);
+    while (record->paths != NULL) {
+        struct TexturePath* entry = record->paths;
+        record->paths = entry->nextpath;
+        entry->record = original;
+        entry->nextpath = original->paths;
+        original->paths = entry;
+    }
+    return true;
+}
+
+
+// Deletes every texture still registered, in ascending name order so shutdown is the same
+// every run. Anything left here was acquired without a matching release.
+void FreeTextureRegistry() {
+    int leaked = 0;
+    for (GLuint i = 0; i < textureregistry.recordcapacity; i++) {
+        struct TextureRecord* record = textureregistry.records[i];
+        if (record != NULL) {
+            leaked += record->refcount > 0;
+            FreeTextureRecord(record);
+        }
+    }
+    if (leaked > 0) {
+        printf("Warning: %d textures were still referenced at shutdown\n", leaked);
+    }
+
+    free(textureregistry.paths);
+    free(textureregistry.contents);
+    free(textureregistry.records);
+    textureregistry = (struct TextureRegistry){0};
+}
+
+
+// Makes room for count more TextureIDs slots after the TextureCount used ones, the caller
+// fills them and adds count to TextureCount
+void AddTextureSlots(int count) {
+    GLuint* newTextureIDs = realloc(TextureIDs, (TextureCount + count) * sizeof(GLuint));
+    int* newTextureLayers = realloc(TextureLayers, (TextureCount + count) * sizeof(int));
+    if (newTextureIDs == NULL || newTextureLayers == NULL) {
+        printf("Failed to allocate memory for textures.\n");
+        exit(1);
+    }
+    TextureIDs = newTextureIDs;
+    TextureLayers = newTextureLayers;
+}
+
+
+// Texture atlas. Many small images are packed into a few large pages, so meshes that used
+// to need a texture each can be drawn with one bind. Every image is surrounded by
+// ATLASPADDING copies of its edge texels and starts on a multiple of ATLASPADDING, and
+// the pages stop their mipmaps at the level where one texel covers the padding, so
+// filtering and mipmapping never pull in a neighbour. The packing is kept in a small text
+// file next to the sources and only redone when a source changes:
+//   CALIUMATLAS 1
+//   padding 4 pages 1 images 2
+//   page <width> <height>
+//   image <page> <x> <y> <width> <height> <file size> <file hash> <path>
+struct AtlasImage {
+    char* path;
+    uint64_t size, hash;            // Of the source file
+    int page, x, y;                 // Lower left corner of the image itself, inside the padding
+    int width, height;
+    unsigned char* pixels;          // Decoded RGBA, only while the atlas is built
+};
+
+struct AtlasPage {
+    int width, height;
+    GLuint texture;
+};
+
+struct TextureAtlas {
+    int imagecount;
+    struct AtlasImage* images;
+    int pagecount;
+    struct AtlasPage* pages;
+};
+
+struct TextureAtlas textureatlas = {0};
+
+
+// Skyline bottom left packing. The skyline is the top edge of everything placed so far,
+// as segments from left to right that cover the whole page width.
+struct SkylineNode {
+    int x, y, width;
+};
+
+struct Skyline {
+    struct SkylineNode* nodes;
+    int count;
+    int size;
+    int usedwidth, usedheight;
+};
+
+
+void InitSkyline(struct Skyline* skyline, int size) {
+    // A skyline can never have more segments than the page is wide
+    skyline->nodes = (struct SkylineNode*)malloc((size + 1) * sizeof(struct SkylineNode));
+    if (skyline->nodes == NULL) {
+        printf("Memory allocation failed for the atlas packer\n");
+        exit(1);
+    }
+    skyline->nodes[0] = (struct SkylineNode){0, 0, size};
+    skyline->count = 1;
+    skyline->size = size;
+    skyline->usedwidth = 0;
+    skyline->usedheight = 0;
+}
+
+
+// Lowest y a width x height rectangle can sit at with its left edge on node index, -1 if it does not fit
+int SkylineFit(const struct Skyline* skyline, int index, int width, int height) {
+    if (skyline->nodes[index].x + width > skyline->size) {
+        return -1;
+    }
+
+    int y = 0;
+    for (int remaining = width; remaining > 0; index++) {
+        if (skyline->nodes[index].y > y) {
+            y = skyline->nodes[index].y;
+        }
+        if (y + height > skyline->size) {
+            return -1;
+        }
+        remaining -= skyline->nodes[index].width;
+    }
+    return y;
+}
+
+
+// Places the rectangle where its top ends up lowest, leftmost on ties
+bool SkylinePack(struct Skyline* skyline, int width, int height, int* x, int* y) {
+    int best = -1, besttop = 0;
+    for (int i = 0; i < skyline->count; i++) {
+        int fit = SkylineFit(skyline, i, width, height);
+        if (fit >= 0 && (best < 0 || fit + height < besttop)) {
+            best = i;
+            besttop = fit + height;
+        }
+    }
+    if (best < 0) {
+        return false;
+    }
+
+    *x = skyline->nodes[best].x;
+    *y = besttop - height;
+
+    // The new segment goes in front of the ones it covers, which get cut back or removed
+    memmove(&skyline->nodes[best + 1], &skyline->nodes[best], (skyline->count - best) * sizeof(struct SkylineNode));
+    skyline->nodes[best] = (struct SkylineNode){*x, besttop, width};
+    skyline->count++;
+
+    int i = best + 1;
+    while (i < skyline->count) {
+        int overlap = *x + width - skyline->nodes[i].x;
+        if (overlap <= 0) {
+            break;
+        }
+        if (overlap < skyline->nodes[i].width) {
+            skyline->nodes[i].x += overlap;
+            skyline->nodes[i].width -= overlap;
+            break;
+        }
+        memmove(&skyline->nodes[i], &skyline->nodes[i + 1], (skyline->count - i - 1) * sizeof(struct SkylineNode));
+        skyline->count--;
+    }
+
+    // Neighbours at the same height become one segment
+    for (i = 0; i + 1 < skyline->count; ) {
+        if (skyline->nodes[i].y == skyline->nodes[i + 1].y) {
+            skyline->nodes[i].width += skyline->nodes[i + 1].width;
+            memmove(&skyline->nodes[i + 1], &skyline->nodes[i + 2], (skyline->count - i - 2) * sizeof(struct SkylineNode));
+            skyline->count--;
+        }
+        else {
+            i++;
+        }
+    }
+
+    if (*x + width > skyline->usedwidth) {
+        skyline->usedwidth = *x + width;
+    }
+    if (besttop > skyline->usedheight) {
+        skyline->usedheight = besttop;
+    }
+    return true;
+}
+
+
+// Space an image takes up on a page, the padding on both sides rounded up to the alignment
+int AtlasSlotSize(int size) {
+    return (size + 2 * ATLASPADDING + ATLASPADDING - 1) / ATLASPADDING * ATLASPADDING;
+}
+
+
+int NextPowerOfTwo(int value) {
+    int power = 1;
+    while (power < value) {
+        power *= 2;
+    }
+    return power;
+}
+
+
+struct AtlasOrder {
+    int index;
+    int width, height;
+};
+
+
+// Tallest first, then widest, then in the given order so the packing is the same every run
+int CompareAtlasOrder(const void* a, const void* b) {
+    const struct AtlasOrder* x = (const struct AtlasOrder*)a;
+    const struct AtlasOrder* y = (const struct AtlasOrder*)b;
+    if (x->height != y->height) {
+        return y->height - x->height;
+    }
+    if (x->width != y->width) {
+        return y->width - x->width;
+    }
+    return x->index - y->index;
+}
+
+
+// Packs the images in the given order onto pages of size x size, opening a new page whenever
+// one does not fit on any earlier page. Returns the amount of pages, 0 when that would be more
+// than maxpages.
+int PackAtlasPages(struct TextureAtlas* atlas, const struct AtlasOrder* order, struct Skyline* skylines, int size, int maxpages) {
+    int pagecount = 0;
+    for (int i = 0; i < atlas->imagecount; i++) {
+        int x, y;
+        int page = 0;
+        while (page < pagecount && !SkylinePack(&skylines[page], order[i].width, order[i].height, &x, &y)) {
+            page++;
+        }
+        if (page == pagecount) {
+            if (pagecount == maxpages) {
+                for (int j = 0; j < pagecount; j++) {
+                    free(skylines[j].nodes);
+                }
+                return 0;
+            }
+            InitSkyline(&skylines[pagecount++], size);
+            SkylinePack(&skylines[page], order[i].width, order[i].height, &x, &y);
+        }
+
+        struct AtlasImage* image = &atlas->images[order[i].index];
+        image->page = page;
+        image->x = x + ATLASPADDING;
+        image->y = y + ATLASPADDING;
+    }
+    return pagecount;
+}
+
+
+// Packs everything on one page when it fits a page of at most pagesize, trying the smallest
+// square that could hold the images first, otherwise on as many full size pages as it takes
+bool PackTextureAtlas(struct TextureAtlas* atlas, int pagesize) {
+    struct AtlasOrder* order = (struct AtlasOrder*)malloc(atlas->imagecount * sizeof(struct AtlasOrder));
+    struct Skyline* skylines = (struct Skyline*)malloc(atlas->imagecount * sizeof(struct Skyline));
+    if (order == NULL || skylines == NULL) {
+        printf("Memory allocation failed for the atlas packer\n");
+        exit(1);
+    }
+
+    double area = 0.0;
+    for (int i = 0; i < atlas->imagecount; i++) {
+        struct AtlasImage* image = &atlas->images[i];
+        order[i] = (struct AtlasOrder){i, AtlasSlotSize(image->width), AtlasSlotSize(image->height)};
+        if (order[i].width > pagesize || order[i].height > pagesize) {
+            printf("Texture %s is %dx%d, too large for %dx%d atlas pages\n", image->path, image->width, image->height, pagesize, pagesize);
+            free(skylines);
+            free(order);
+            return false;
+        }
+        area += (double)order[i].width * order[i].height;
+    }
+    qsort(order, atlas->imagecount, sizeof(struct AtlasOrder), CompareAtlasOrder);
+
+    int pagecount = 0;
+    for (int size = NextPowerOfTwo((int)ceil(sqrt(area))); size < pagesize && pagecount == 0; size *= 2) {
+        pagecount = PackAtlasPages(atlas, order, skylines, size, 1);
+    }
+    if (pagecount == 0) {
+        pagecount = PackAtlasPages(atlas, order, skylines, pagesize, atlas->imagecount);
+    }
+
+    // Pages only grow as large as what is on them
+    atlas->pagecount = pagecount;
+    atlas->pages = (struct AtlasPage*)calloc(pagecount, sizeof(struct AtlasPage));
+    if (atlas->pages == NULL) {
+        printf("Memory allocation failed for the atlas pages\n");
+        exit(1);
+    }
+    for (int i = 0; i < pagecount; i++) {
+        atlas->pages[i].width = NextPowerOfTwo(skylines[i].usedwidth);
+        atlas->pages[i].height = NextPowerOfTwo(skylines[i].usedheight);
+        free(skylines[i].nodes);
+    }
+
+    free(skylines);
+    free(order);
+    return true;
+}
+
+
+// Takes the packing from a layout file when it was made from exactly these sources
+bool LoadAtlasLayout(const char* path, struct TextureAtlas* atlas, int pagesize) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    int version = 0, padding = 0, pagecount = 0, imagecount = 0;
+    bool valid = fscanf(file, "CALIUMATLAS %d padding %d pages %d images %d", &version, &padding, &pagecount, &imagecount) == 4 &&
+                 version == ATLASVERSION && padding == ATLASPADDING && pagecount > 0 && imagecount == atlas->imagecount;
+
+    struct AtlasPage* pages = valid ? (struct AtlasPage*)calloc(pagecount, sizeof(struct AtlasPage)) : NULL;
+    for (int i = 0; valid && i < pagecount; i++) {
+        valid = pages != NULL && fscanf(file, " page %d %d", &pages[i].width, &pages[i].height) == 2 &&
+                pages[i].width > 0 && pages[i].width <= pagesize && pages[i].height > 0 && pages[i].height <= pagesize;
+    }
+
+    char line[4096];
+    for (int i = 0; valid && i < imagecount; i++) {
+        struct AtlasImage* image = &atlas->images[i];
+        int page, x, y, width, height;
+        unsigned long long size, hash;
+        valid = fscanf(file, " image %d %d %d %d %d %llu %llx ", &page, &x, &y, &width, &height, &size, &hash) == 7 &&
+                fgets(line, sizeof(line), file) != NULL;
+        if (!valid) {
+            break;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        valid = strcmp(line, image->path) == 0 && size == image->size && hash == image->hash &&
+                width == image->width && height == image->height && page >= 0 && page < pagecount &&
+                x >= ATLASPADDING && y >= ATLASPADDING &&
+                x + width + ATLASPADDING <= pages[page].width && y + height + ATLASPADDING <= pages[page].height;
+        image->page = page;
+        image->x = x;
+        image->y = y;
+    }
+    fclose(file);
+
+    if (!valid) {
+        free(pages);
+        return false;
+    }
+    atlas->pagecount = pagecount;
+    atlas->pages = pages;
+    return true;
+}
+
+
+// Written next to the real file and renamed over it, so a crash never leaves half a layout
+void WriteAtlasLayout(const char* path, const struct TextureAtlas* atlas) {
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE* file = fopen(temporary, "w");
+    if (file == NULL) {
+        printf("Error opening %s for writing, the atlas is packed again next run\n", temporary);
+        return;
+    }
+
+    fprintf(file, "CALIUMATLAS %d\npadding %d pages %d images %d\n", ATLASVERSION, ATLASPADDING, atlas->pagecount, atlas->imagecount);
+    for (int i = 0; i < atlas->pagecount; i++) {
+        fprintf(file, "page %d %d\n", atlas->pages[i].width, atlas->pages[i].height);
+    }
+    for (int i = 0; i < atlas->imagecount; i++) {
+        const struct AtlasImage* image = &atlas->images[i];
+        fprintf(file, "image %d %d %d %d %d %llu %llx %s\n", image->page, image->x, image->y, image->width, image->height,
+                (unsigned long long)image->size, (unsigned long long)image->hash, image->path);
+    }
+
+    if (fclose(file) != 0 || rename(temporary, path) != 0) {
+        printf("Error writing the atlas layout %s\n", path);
+        remove(temporary);
+    }
+}
+
+
+void DecodeAtlasImages(void* data, int start, int end) {
+    struct AtlasImage* images = (struct AtlasImage*)data;
+    stbi_set_flip_vertically_on_load_thread(1);
+    for (int i = start; i < end; i++) {
+        images[i].pixels = LoadImageFile(images[i].path, &images[i].width, &images[i].height, &images[i].size, &images[i].hash);
+    }
+}
+
+
+// Copies an image and the padding around it into its page, the padding repeats the edge texels
+void CopyAtlasImage(unsigned char* page, int pagewidth, const struct AtlasImage* image) {
+    for (int row = -ATLASPADDING; row < image->height + ATLASPADDING; row++) {
+        int sourcerow = row < 0 ? 0 : (row >= image->height ? image->height - 1 : row);
+        const unsigned char* source = image->pixels + (size_t)sourcerow * image->width * 4;
+        unsigned char* target = page + ((size_t)(image->y + row) * pagewidth + image->x) * 4;
+
+        for (int column = -ATLASPADDING; column < 0; column++) {
+            memcpy(target + column * 4, source, 4);
+        }
+        memcpy(target, source, (size_t)image->width * 4);
+        for (int column = image->width; column < image->width + ATLASPADDING; column++) {
+            memcpy(target + column * 4, source + (image->width - 1) * 4, 4);
+        }
+    }
+}
+
+
+// Loads the images into atlas pages, packing them again unless the layout file still matches.
+// The pages go in the texture registry as "<layout>#<page>" with one reference held by the
+// atlas. Returns false and leaves the atlas empty when an image cannot be loaded or packed.
+bool BuildTextureAtlas(const char* layoutpath, int count, const char** filenames, struct TextureAtlas* atlas) {
+    long long start = MonotonicNanoseconds();
+    *atlas = (struct TextureAtlas){0};
+    if (count <= 0) {
+        return false;
+    }
+
+    atlas->imagecount = count;
+    atlas->images = (struct AtlasImage*)calloc(count, sizeof(struct AtlasImage));
+    if (atlas->images == NULL) {
+        printf("Memory allocation failed for the texture atlas\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        atlas->images[i].path = strdup(filenames[i]);
+        if (atlas->images[i].path == NULL) {
+            printf("Memory allocation failed for the texture atlas\n");
+            exit(1);
+        }
+    }
+
+    // The layout check needs the hashes anyway, so every image is decoded up front, in parallel
+    ParallelFor(DecodeAtlasImages, atlas->images, count, 1);
+
+    bool loaded = true;
+    for (int i = 0; i < count; i++) {
+        if (atlas->images[i].pixels == NULL) {
+            printf("Error in loading atlas image: %s\n", atlas->images[i].path);
+            loaded = false;
+        }
+    }
+
+    GLint maxsize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize);
+    int pagesize = maxsize > 0 && maxsize < ATLASPAGESIZE ? maxsize : ATLASPAGESIZE;
+
+    bool cached = loaded && LoadAtlasLayout(layoutpath, atlas, pagesize);
+    if (loaded && !cached) {
+        loaded = PackTextureAtlas(atlas, pagesize);
+        if (loaded) {
+            WriteAtlasLayout(layoutpath, atlas);
+        }
+    }
+
+    for (int i = 0; loaded && i < atlas->pagecount; i++) {
+        struct AtlasPage* page = &atlas->pages[i];
+        unsigned char* pixels = (unsigned char*)calloc((size_t)page->width * page->height, 4);
+        if (pixels == NULL) {
+            printf("Memory allocation failed for an atlas page\n");
+            exit(1);
+        }
+        for (int j = 0; j < count; j++) {
+            if (atlas->images[j].page == i) {
+                CopyAtlasImage(pixels, page->width, &atlas->images[j]);
+            }
+        }
+
+        // Mip level n averages 2^n texels, no further than the padding reaches. Minified pages
+        // sample the nearest level, so distant tiles stop shimmering without losing the hard
+        // texel edges of the other textures.
+        int maxlevel = 0;
+        while ((2 << maxlevel) <= ATLASPADDING) {
+            maxlevel++;
+        }
+
+        glGenTextures(1, &page->texture);
+        BindTexture(page->texture);
+        SetTextureParameters();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, maxlevel);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, page->width, page->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        free(pixels);
+
+        char name[4096];
+        snprintf(name, sizeof(name), "%s#%d", layoutpath, i);
+        RegisterTexture(page->texture, name);
+    }
+
+    for (int i = 0; i < count; i++) {
+        stbi_image_free(atlas->images[i].pixels);
+        atlas->images[i].pixels = NULL;
+    }
+
+    if (!loaded) {
+        for (int i = 0; i < count; i++) {
+            free(atlas->images[i].path);
+        }
+        free(atlas->images);
+        free(atlas->pages);
+        *atlas = (struct TextureAtlas){0};
+        return false;
+    }
+
+    printf("Texture atlas %s: %d images on %d pages, %s in %.1f ms\n", layoutpath, count, atlas->pagecount,
+           cached ? "cached layout" : "packed", (MonotonicNanoseconds() - start) / 1e6);
+    return true;
+}
+
+
+// Moves the texture coordinates of a mesh into the rectangle of one atlas image and updates
+// its vertex buffer. Meshes sharing a vertex buffer must only be remapped once. Coordinates
+// outside [0, 1] are clamped, the same as the clamped wrapping of a texture of its own.
+void RemapAtlasUVs(struct object* Object, const struct TextureAtlas* atlas, int image) {
+    const struct AtlasImage* rect = &atlas->images[image];
+    const struct AtlasPage* page = &atlas->pages[rect->page];
+
+    int clamped = 0;
+    for (int i = 0; i < Object->vertexnum; i++) {
+        struct vertex* vertex = &Object->vertices[i];
+        float u = vertex->u < 0.0f ? 0.0f : (vertex->u > 1.0f ? 1.0f : vertex->u);
+        float v = vertex->v < 0.0f ? 0.0f : (vertex->v > 1.0f ? 1.0f : vertex->v);
+        clamped += u != vertex->u || v != vertex->v;
+        vertex->u = (rect->x + u * rect->width) / page->width;
+        vertex->v = (rect->y + v * rect->height) / page->height;
+    }
+    if (clamped > 0) {
+        printf("Warning: %d texture coordinates were clamped to fit %s in the atlas\n", clamped, rect->path);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, Object->vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, Object->vertexnum * sizeof(struct vertex), Object->vertices);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+// Appends one reference to the page of every atlas image to TextureIDs, in image order
+void LoadAtlasTextures(const struct TextureAtlas* atlas) {
+    AddTextureSlots(atlas->imagecount);
+    for (int i = 0; i < atlas->imagecount; i++) {
+        TextureIDs[TextureCount + i] = RetainTexture(atlas->pages[atlas->images[i].page].texture);
+        TextureLayers[TextureCount + i] = -1;
+    }
+    TextureCount += atlas->imagecount;
+}
+
+
+// Drops the references of the atlas to its pages and forgets the layout
+void FreeTextureAtlas(struct TextureAtlas* atlas) {
+    for (int i = 0; i < atlas->pagecount; i++) {
+        ReleaseTexture(atlas->pages[i].texture);
+    }
+    for (int i = 0; i < atlas->imagecount; i++) {
+        free(atlas->images[i].path);
+    }
+    free(atlas->images);
+    free(atlas->pages);
+    *atlas = (struct TextureAtlas){0};
+}
+
+
+// Loads same sized images as the layers of one array texture and appends a slot per image to
+// TextureIDs, each with its layer in TextureLayers. Unlike atlas pages the layers wrap on their
+// own, so tiling textures keep repeating without bleeding into each other. The array goes in
+// the texture registry under the file names joined by '|'. Returns false and appends nothing
+// when array textures are off or the images can not be loaded or differ in size.
+bool LoadTextureArray(int count, const char** filenames) {
+    if (!TEXTUREARRAYS || count <= 0) {
+        return false;
+    }
+
+    GLint maxlayers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxlayers);
+    if (count > maxlayers) {
+        printf("%d textures do not fit one array texture, the limit is %d layers\n", count, maxlayers);
+        return false;
+    }
+
+    struct AtlasImage* images = (struct AtlasImage*)calloc(count, sizeof(struct AtlasImage));
+    size_t namelength = 1;
+    for (int i = 0; i < count; i++) {
+        namelength += strlen(filenames[i]) + 1;
+    }
+    char* name = (char*)malloc(namelength);
+    if (images == NULL || name == NULL) {
+        printf("Memory allocation failed for the array texture\n");
+        exit(1);
+    }
+
+    // Decoded in parallel the same way as the atlas images
+    name[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        images[i].path = (char*)filenames[i];
+        strcat(name, filenames[i]);
+        strcat(name, i + 1 < count ? "|" : "");
+    }
+    ParallelFor(DecodeAtlasImages, images, count, 1);
+
+    bool loaded = true;
+    for (int i = 0; i < count && loaded; i++) {
+        if (images[i].pixels == NULL) {
+            printf("Error in loading texture image: %s\n", filenames[i]);
+            loaded = false;
+        }
+        else if (images[i].width != images[0].width || images[i].height != images[0].height) {
+            printf("Texture %s is %dx%d, the other layers are %dx%d\n", filenames[i], images[i].width, images[i].height, images[0].width, images[0].height);
+            loaded = false;
+        }
+    }
+
+    if (loaded) {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        BindTextureArray(texture);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, images[0].width, images[0].height, count, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        for (int i = 0; i < count; i++) {
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, images[i].width, images[i].height, 1, GL_RGBA, GL_UNSIGNED_BYTE, images[i].pixels);
+        }
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+        // Every slot holds a reference of its own, the one from registering is handed back
+        RegisterTexture(texture, name);
+        AddTextureSlots(count);
+        for (int i = 0; i < count; i++) {
+            TextureIDs[TextureCount + i] = RetainTexture(texture);
+            TextureLayers[TextureCount + i] = i;
+        }
+        TextureCount += count;
+        ReleaseTexture(texture);
+        printf("Array texture %u: %d layers of %dx%d\n", texture, count, images[0].width, images[0].height);
+    }
+
+    for (int i = 0; i < count; i++) {
+        stbi_image_free(images[i].pixels);
+    }
+    free(images);
+    free(name);
+    return loaded;
+}
+
+
+struct color LambertianDiffuse(struct vector3 normal, struct vector3 midpoint, struct Light* lights, int lightCount) {
+    struct color totalDiffuse = {0.0f, 0.0f, 0.0f, 1.0f}; // Initialize to black
+
+    // Loop through all the lights
+    for (int i = 0; i < lightCount; i++) {
+        // Vector from the midpoint to the light
+        struct vector3 lightDir = {lights[i].position.x - midpoint.x, 
+                                   lights[i].position.y - midpoint.y, 
+                                   lights[i].position.z - midpoint.z};
+        
+        // Calculate the distance between the midpoint and the light source
+        float distance = sqrt(lightDir.x * lightDir.x + lightDir.y * lightDir.y + lightDir.z * lightDir.z);
+
+        // Normalize light direction
+        lightDir = normalize(lightDir); 
+
+        // Calculate the Lambertian diffuse intensity (clamped to non-negative)
+        float diffuseIntensity = fmax(0.0f, dotProduct(normal, lightDir)) * lights[i].intensity;
+
+        // Apply distance attenuation (inverse square law)
+        if (diffuseIntensity > 0.0f && distance > 0.0f) {
+            // Attenuate light intensity with distance
+            float attenuation = 1.0f / (distance * distance);
+
+            // Apply the attenuation and add the contribution of the current light source
+            totalDiffuse.r += diffuseIntensity * lights[i].color.r * attenuation;
+            totalDiffuse.g += diffuseIntensity * lights[i].color.g * attenuation;
+            totalDiffuse.b += diffuseIntensity * lights[i].color.b * attenuation;
+        }
+    }
+
+    // Ensure the color components are clamped between 0 and 1
+    if (totalDiffuse.r > 1.0f) totalDiffuse.r = 1.0f;
+    if (totalDiffuse.g > 1.0f) totalDiffuse.g = 1.0f;
+    if (totalDiffuse.b > 1.0f) totalDiffuse.b = 1.0f;
+
+    // Ensure the color components are above a certain threshold
+    if (totalDiffuse.r < 0.05f) totalDiffuse.r = 0.05f;
+    if (totalDiffuse.g < 0.05f) totalDiffuse.g = 0.05f;
+    if (totalDiffuse.b < 0.05f) totalDiffuse.b = 0.05f;
+
+    return totalDiffuse;
+}
+
+
+float Random(){
+    float min = 0.0f;
+    float max = 1.0f;
+
+    // Generate a random floating-point number between min and max
+    float randomFloat = min + (float)rand() / RAND_MAX * (max - min);
+    return randomFloat;
+}
+
+
+// Structure of arrays input for shading many triangles at once
+struct ShadeBatch {
+    int count;
+    float *nx, *ny, *nz;    // Unit face normals, already oriented
+    float *cx, *cy, *cz;    // Face centers
+    float *r, *g, *b;       // Output diffuse color
+};
+
+
+// Structure of arrays copy of a struct Light list
+struct LightBatch {
+    int count;
+    float *x, *y, *z;
+    float *r, *g, *b;
+    float *intensity;
+};
+
+
+// Scalar reference, same math as LambertianDiffuse for checking the SIMD kernels
+void LambertianDiffuseBatchScalar(struct ShadeBatch* batch, const struct LightBatch* lights, int start) {
+    for (int i = start; i < batch->count; i++) {
+        float r = 0.0f, g = 0.0f, b = 0.0f;
+
+        for (int l = 0; l < lights->count; l++) {
+            float dx = lights->x[l] - batch->cx[i];
+            float dy = lights->y[l] - batch->cy[i];
+            float dz = lights->z[l] - batch->cz[i];
+
+            float distance2 = dx * dx + dy * dy + dz * dz;
+            float distance = sqrtf(distance2);
+
+            float diffuseIntensity = (batch->nx[i] * dx + batch->ny[i] * dy + batch->nz[i] * dz) / distance;
+            diffuseIntensity = fmaxf(0.0f, diffuseIntensity) * lights->intensity[l];
+
+            if (diffuseIntensity > 0.0f && distance > 0.0f) {
+                float attenuation = diffuseIntensity / distance2;
+                r += lights->r[l] * attenuation;
+                g += lights->g[l] * attenuation;
+                b += lights->b[l] * attenuation;
+            }
+        }
+
+        batch->r[i] = fminf(fmaxf(r, 0.05f), 1.0f);
+        batch->g[i] = fminf(fmaxf(g, 0.05f), 1.0f);
+        batch->b[i] = fminf(fmaxf(b, 0.05f), 1.0f);
+    }
+}
+
+
+#ifdef CALIUM_X86
+__attribute__((target("sse2")))
+void LambertianDiffuseBatchSSE2(struct ShadeBatch* batch, const struct LightBatch* lights, int start) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 low = _mm_set1_ps(0.05f);
+    const __m128 high = _mm_set1_ps(1.0f);
+
+    int i = start;
+    for (; i + 4 <= batch->count; i += 4) {
+        __m128 nx = _mm_loadu_ps(batch->nx + i);
+        __m128 ny = _mm_loadu_ps(batch->ny + i);
+        __m128 nz = _mm_loadu_ps(batch->nz + i);
+        __m128 cx = _mm_loadu_ps(batch->cx + i);
+        __m128 cy = _mm_loadu_ps(batch->cy + i);
+        __m128 cz = _mm_loadu_ps(batch->cz + i);
+        __m128 r = zero, g = zero, b = zero;
+
+        for (int l = 0; l < lights->count; l++) {
+            __m128 dx = _mm_sub_ps(_mm_set1_ps(lights->x[l]), cx);
+            __m128 dy = _mm_sub_ps(_mm_set1_ps(lights->y[l]), cy);
+            __m128 dz = _mm_sub_ps(_mm_set1_ps(lights->z[l]), cz);
+
+            __m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            __m128 distance = _mm_sqrt_ps(distance2);
+
+            __m128 ndotl = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, dx), _mm_mul_ps(ny, dy)), _mm_mul_ps(nz, dz));
+
+            // A zero distance gives NaN here, and max(NaN, 0) returns 0 just like fmax
+            __m128 diffuseIntensity = _mm_max_ps(_mm_div_ps(ndotl, distance), zero);
+            diffuseIntensity = _mm_mul_ps(diffuseIntensity, _mm_set1_ps(lights->intensity[l]));
+
+            __m128 mask = _mm_and_ps(_mm_cmpgt_ps(diffuseIntensity, zero), _mm_cmpgt_ps(distance, zero));
+            __m128 attenuation = _mm_and_ps(mask, _mm_div_ps(diffuseIntensity, distance2));
+
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(lights->r[l]), attenuation));
+            g = _mm_add_ps(g, _mm_mul_ps(_mm_set1_ps(lights->g[l]), attenuation));
+            b = _mm_add_ps(b, _mm_mul_ps(_mm_set1_ps(lights->b[l]), attenuation));
+        }
+
+        _mm_storeu_ps(batch->r + i, _mm_min_ps(_mm_max_ps(r, low), high));
+        _mm_storeu_ps(batch->g + i, _mm_min_ps(_mm_max_ps(g, low), high));
+        _mm_storeu_ps(batch->b + i, _mm_min_ps(_mm_max_ps(b, low), high));
+    }
+
+    // Leftover triangles
+    LambertianDiffuseBatchScalar(batch, lights, i);
+}
+
+
+__attribute__((target("avx2")))
+void LambertianDiffuseBatchAVX2(struct ShadeBatch* batch, const struct LightBatch* lights, int start) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 low = _mm256_set1_ps(0.05f);
+    const __m256 high = _mm256_set1_ps(1.0f);
+
+    int i = start;
+    for (; i + 8 <= batch->count; i += 8) {
+        __m256 nx = _mm256_loadu_ps(batch->nx + i);
+        __m256 ny = _mm256_loadu_ps(batch->ny + i);
+        __m256 nz = _mm256_loadu_ps(batch->nz + i);
+        __m256 cx = _mm256_loadu_ps(batch->cx + i);
+        __m256 cy = _mm256_loadu_ps(batch->cy + i);
+        __m256 cz = _mm256_loadu_ps(batch->cz + i);
+        __m256 r = zero, g = zero, b = zero;
+
+        for (int l = 0; l < lights->count; l++) {
+            __m256 dx = _mm256_sub_ps(_mm256_set1_ps(lights->x[l]), cx);
+            __m256 dy = _mm256_sub_ps(_mm256_set1_ps(lights->y[l]), cy);
+            __m256 dz = _mm256_sub_ps(_mm256_set1_ps(lights->z[l]), cz);
+
+            __m256 distance2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+            __m256 distance = _mm256_sqrt_ps(distance2);
+
+            __m256 ndotl = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, dx), _mm256_mul_ps(ny, dy)), _mm256_mul_ps(nz, dz));
+
+            // A zero distance gives NaN here, and max(NaN, 0) returns 0 just like fmax
+            __m256 diffuseIntensity = _mm256_max_ps(_mm256_div_ps(ndotl, distance), zero);
+            diffuseIntensity = _mm256_mul_ps(diffuseIntensity, _mm256_set1_ps(lights->intensity[l]));
+
+            __m256 mask = _mm256_and_ps(_mm256_cmp_ps(diffuseIntensity, zero, _CMP_GT_OQ), _mm256_cmp_ps(distance, zero, _CMP_GT_OQ));
+            __m256 attenuation = _mm256_and_ps(mask, _mm256_div_ps(diffuseIntensity, distance2));
+
+            r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_set1_ps(lights->r[l]), attenuation));
+            g = _mm256_add_ps(g, _mm256_mul_ps(_mm256_set1_ps(lights->g[l]), attenuation));
+            b = _mm256_add_ps(b, _mm256_mul_ps(_mm256_set1_ps(lights->b[l]), attenuation));
+        }
+
+        _mm256_storeu_ps(batch->r + i, _mm256_min_ps(_mm256_max_ps(r, low), high));
+        _mm256_storeu_ps(batch->g + i, _mm256_min_ps(_mm256_max_ps(g, low), high));
+        _mm256_storeu_ps(batch->b + i, _mm256_min_ps(_mm256_max_ps(b, low), high));
+    }
+
+    // Leftover triangles go through the 4 wide kernel
+    LambertianDiffuseBatchSSE2(batch, lights, i);
+}
+#endif
+
+
+// Batched lighting kernel, picked for the running CPU by SelectLightingKernel
+void (*LambertianDiffuseBatchKernel)(struct ShadeBatch*, const struct LightBatch*, int) = LambertianDiffuseBatchScalar;
+const char* LightingKernelName = "scalar";
+
+
+void SelectLightingKernel() {
+#ifdef CALIUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        LambertianDiffuseBatchKernel = LambertianDiffuseBatchAVX2;
+        LightingKernelName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        LambertianDiffuseBatchKernel = LambertianDiffuseBatchSSE2;
+        LightingKernelName = "sse2";
+    }
+#endif
+}
+
+
+// Shades batch->count triangles against every light in one call
+void LambertianDiffuseBatch(struct ShadeBatch* batch, const struct LightBatch* lights) {
+    LambertianDiffuseBatchKernel(batch, lights, 0);
+}
+
+
+// Grows the arrays of a batch so it can hold at least count entries
+void ReserveShadeBatch(struct ShadeBatch* batch, int* capacity, int count) {
+    if (count <= *capacity) {
+        return;
+    }
+
+    float** arrays[9] = {&batch->nx, &batch->ny, &batch->nz, &batch->cx, &batch->cy, &batch->cz, &batch->r, &batch->g, &batch->b};
+    for (int i = 0; i < 9; i++) {
+        float* grown = (float*)realloc(*arrays[i], count * sizeof(float));
+        if (grown == NULL) {
+            printf("Memory allocation failed for the shade batch\n");
+            exit(1);
+        }
+        *arrays[i] = grown;
+    }
+    *capacity = count;
+}
+
+
+void FillLightBatch(struct LightBatch* batch, int* capacity, struct Light* lights, int lightcount) {
+    if (lightcount > *capacity) {
+        float** arrays[7] = {&batch->x, &batch->y, &batch->z, &batch->r, &batch->g, &batch->b, &batch->intensity};
+        for (int i = 0; i < 7; i++) {
+            float* grown = (float*)realloc(*arrays[i], lightcount * sizeof(float));
+            if (grown == NULL) {
+                printf("Memory allocation failed for the light batch\n");
+                exit(1);
+            }
+            *arrays[i] = grown;
+        }
+        *capacity = lightcount;
+    }
+
+    batch->count = lightcount;
+    for (int i = 0; i < lightcount; i++) {
+        batch->x[i] = lights[i].position.x;
+        batch->y[i] = lights[i].position.y;
+        batch->z[i] = lights[i].position.z;
+        batch->r[i] = lights[i].color.r;
+        batch->g[i] = lights[i].color.g;
+        batch->b[i] = lights[i].color.b;
+        batch->intensity[i] = lights[i].intensity;
+    }
+}
+
+
+void FreeShadeBatch(struct ShadeBatch* batch) {
+    free(batch->nx); free(batch->ny); free(batch->nz);
+    free(batch->cx); free(batch->cy); free(batch->cz);
+    free(batch->r); free(batch->g); free(batch->b);
+    *batch = (struct ShadeBatch){0};
+}
+
+
+void FreeLightBatch(struct LightBatch* batch) {
+    free(batch->x); free(batch->y); free(batch->z);
+    free(batch->r); free(batch->g); free(batch->b);
+    free(batch->intensity);
+    *batch = (struct LightBatch){0};
+}
+
+
+// Everything ShadeMesh needs between calls, a thread must only use its own
+struct MeshLighting {
+    struct ShadeBatch shades;
+    int shadecapacity;
+    struct LightBatch lights;
+    int lightcapacity;
+    struct vector3* normals;
+    struct vector3* centers;
+    int* faces;
+    int facecapacity;
+};
+
+
+void FreeMeshLighting(struct MeshLighting* scratch) {
+    FreeShadeBatch(&scratch->shades);
+    FreeLightBatch(&scratch->lights);
+    free(scratch->normals);
+    free(scratch->centers);
+    free(scratch->faces);
+    *scratch = (struct MeshLighting){0};
+}
+
+
+// Runs every available kernel on random data and compares it against the scalar reference
+void CheckLightingKernels() {
+    int count = 1027;
+    int lightcount = 7;
+    int capacity = 0, lightcapacity = 0;
+    struct ShadeBatch reference = {0}, batch = {0};
+    struct LightBatch lightbatch = {0};
+    struct Light lights[7];
+
+    ReserveShadeBatch(&reference, &capacity, count);
+    capacity = 0;
+    ReserveShadeBatch(&batch, &capacity, count);
+    reference.count = batch.count = count;
+
+    for (int i = 0; i < lightcount; i++) {
+        lights[i].position = (struct vector3){Random() * 8.0f - 4.0f, Random() * 8.0f - 4.0f, Random() * 8.0f - 4.0f};
+        lights[i].color = (struct color){Random(), Random(), Random(), 1.0f};
+        lights[i].intensity = Random() * 10.0f;
+    }
+    FillLightBatch(&lightbatch, &lightcapacity, lights, lightcount);
+
+    for (int i = 0; i < count; i++) {
+        struct vector3 normal = normalize((struct vector3){Random() - 0.5f, Random() - 0.5f, Random() - 0.5f});
+        reference.nx[i] = batch.nx[i] = normal.x;
+        reference.ny[i] = batch.ny[i] = normal.y;
+        reference.nz[i] = batch.nz[i] = normal.z;
+        reference.cx[i] = batch.cx[i] = Random() * 4.0f - 2.0f;
+        reference.cy[i] = batch.cy[i] = Random() * 4.0f - 2.0f;
+        reference.cz[i] = batch.cz[i] = Random() * 4.0f - 2.0f;
+    }
+
+    LambertianDiffuseBatchScalar(&reference, &lightbatch, 0);
+
+    struct { const char* name; void (*kernel)(struct ShadeBatch*, const struct LightBatch*, int); } kernels[3];
+    int kernelcount = 0;
+    kernels[kernelcount++] = (typeof(kernels[0])){"scalar", LambertianDiffuseBatchScalar};
+#ifdef CALIUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) kernels[kernelcount++] = (typeof(kernels[0])){"sse2", LambertianDiffuseBatchSSE2};
+    if (__builtin_cpu_supports("avx2")) kernels[kernelcount++] = (typeof(kernels[0])){"avx2", LambertianDiffuseBatchAVX2};
+#endif
+
+    for (int k = 0; k < kernelcount; k++) {
+        kernels[k].kernel(&batch, &lightbatch, 0);
+
+        float maxerror = 0.0f;
+        for (int i = 0; i < count; i++) {
+            maxerror = fmaxf(maxerror, fabsf(batch.r[i] - reference.r[i]));
+            maxerror = fmaxf(maxerror, fabsf(batch.g[i] - reference.g[i]));
+            maxerror = fmaxf(maxerror, fabsf(batch.b[i] - reference.b[i]));
+        }
+        printf("Lighting kernel %-6s max error %g %s\n", kernels[k].name, maxerror, maxerror < 1e-5f ? "OK" : "MISMATCH");
+    }
+
+    FreeShadeBatch(&reference);
+    FreeShadeBatch(&batch);
+    FreeLightBatch(&lightbatch);
+}
+
+
+// Put in front of every shader. The layered variants sample a layer of an array texture, which
+// GLSL 1.20 only has through the extension, and pass the vertex color on for CPU lighting.
+const char* ShaderHeader = "#version 120\n";
+const char* LayeredShaderHeader =
+    "#version 120\n"
+    "#extension GL_EXT_texture_array : require\n"
+    "#define TEXTUREARRAY\n";
+
+const char* LightingVertexShader =
+    "uniform mat4 Model;\n"
+    "uniform mat3 NormalMatrix;\n"
+    "varying vec3 LightPosition;\n"
+    "varying vec3 LightNormal;\n"
+    "#ifdef TEXTUREARRAY\n"
+    "attribute float Layer;\n"
+    "varying float TextureLayer;\n"
+    "#endif\n"
+    "void main() {\n"
+    "    // Lighting happens in world space, like the CPU path\n"
+    "    LightPosition = (Model * gl_Vertex).xyz;\n"
+    "    LightNormal = NormalMatrix * gl_Normal;\n"
+    "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+    "#ifdef TEXTUREARRAY\n"
+    "    TextureLayer = Layer;\n"
+    "    gl_FrontColor = gl_Color;\n"
+    "#endif\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;\n"
+    "}\n";
+
+// Same as LightingVertexShader, but the model and normal matrix come from per-instance attributes
+const char* InstancedLightingVertexShader =
+    "attribute mat4 InstanceModel;\n"
+    "attribute mat3 InstanceNormalMatrix;\n"
+    "varying vec3 LightPosition;\n"
+    "varying vec3 LightNormal;\n"
+    "#ifdef TEXTUREARRAY\n"
+    "attribute float Layer;\n"
+    "varying float TextureLayer;\n"
+    "#endif\n"
+    "void main() {\n"
+    "    LightPosition = (InstanceModel * gl_Vertex).xyz;\n"
+    "    LightNormal = InstanceNormalMatrix * gl_Normal;\n"
+    "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+    "#ifdef TEXTUREARRAY\n"
+    "    TextureLayer = Layer;\n"
+    "    gl_FrontColor = gl_Color;\n"
+    "#endif\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * (InstanceModel * gl_Vertex);\n"
+    "}\n";
+
+const char* LightingFragmentShader =
+    "#define MAXSHADERLIGHTS 16\n"
+    "#ifdef TEXTUREARRAY\n"
+    "uniform sampler2DArray Texture;\n"
+    "varying float TextureLayer;\n"
+    "vec4 TextureColor() { return texture2DArray(Texture, vec3(gl_TexCoord[0].st, TextureLayer)); }\n"
+    "#else\n"
+    "uniform sampler2D Texture;\n"
+    "vec4 TextureColor() { return texture2D(Texture, gl_TexCoord[0].st); }\n"
+    "#endif\n"
+    "uniform bool Lit;\n"
+    "uniform int LightCount;\n"
+    "uniform vec3 LightPositions[MAXSHADERLIGHTS];\n"
+    "uniform vec3 LightColors[MAXSHADERLIGHTS];\n"
+    "uniform float LightIntensities[MAXSHADERLIGHTS];\n"
+    "varying vec3 LightPosition;\n"
+    "varying vec3 LightNormal;\n"
+    "void main() {\n"
+    "    if (!Lit) {\n"
+    "#ifdef TEXTUREARRAY\n"
+    "        // The vertex colors carry the CPU lighting, or white when flat shaded\n"
+    "        gl_FragColor = TextureColor() * gl_Color;\n"
+    "#else\n"
+    "        gl_FragColor = TextureColor();\n"
+    "#endif\n"
+    "        return;\n"
+    "    }\n"
+    "    vec3 normal = normalize(LightNormal);\n"
+    "    vec3 diffuse = vec3(0.0);\n"
+    "    for (int i = 0; i < MAXSHADERLIGHTS; i++) {\n"
+    "        if (i >= LightCount) break;\n"
+    "        vec3 lightDir = LightPositions[i] - LightPosition;\n"
+    "        float distance = length(lightDir);\n"
+    "        float intensity = max(0.0, dot(normal, lightDir / distance)) * LightIntensities[i];\n"
+    "        if (intensity > 0.0 && distance > 0.0) {\n"
+    "            // Inverse square falloff\n"
+    "            diffuse += intensity * LightColors[i] / (distance * distance);\n"
+    "        }\n"
+    "    }\n"
+    "    diffuse = clamp(diffuse, 0.05, 1.0);\n"
+    "    gl_FragColor = TextureColor() * vec4(diffuse, 1.0);\n"
+    "}\n";
+
+
+GLuint CompileShader(GLenum type, const char* header, const char* source) {
+    GLuint shader = glCreateShader(type);
+    const char* sources[2] = {header, source};
+    glShaderSource(shader, 2, sources, NULL);
+    glCompileShader(shader);
+
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        printf("Error: Failed to compile shader:\n%s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
+}
+
+
+GLuint CreateShaderProgramWithAttributes(const char* header, const char* vertexsource, const char* fragmentsource, const char** attributes, const GLuint* locations, int attributecount) {
+    GLuint vertexshader = CompileShader(GL_VERTEX_SHADER, header, vertexsource);
+    GLuint fragmentshader = CompileShader(GL_FRAGMENT_SHADER, header, fragmentsource);
+    if (vertexshader == 0 || fragmentshader == 0) {
+        glDeleteShader(vertexshader);
+        glDeleteShader(fragmentshader);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexshader);
+    glAttachShader(program, fragmentshader);
+
+    // Attribute locations only take effect when the program is linked
+    for (int i = 0; i < attributecount; i++) {
+        glBindAttribLocation(program, locations[i], attributes[i]);
+    }
+    glLinkProgram(program);
+
+    // The program keeps the compiled code, the shader objects are no longer needed
+    glDeleteShader(vertexshader);
+    glDeleteShader(fragmentshader);
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        printf("Error: Failed to link shader program:\n%s\n", log);
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    return program;
+}
+
+
+GLuint CreateShaderProgram(const char* vertexsource, const char* fragmentsource) {
+    return CreateShaderProgramWithAttributes(ShaderHeader, vertexsource, fragmentsource, NULL, NULL, 0);
+}
+
+
+void InitShaderLighting() {
+    if (!SHADERLIGHTING) {
+        return;
+    }
+
+    LightingProgram = CreateShaderProgram(LightingVertexShader, LightingFragmentShader);
+    if (LightingProgram == 0) {
+        // Keep rendering with LambertianDiffuse on the CPU
+        printf("Shader lighting unavailable, falling back to CPU lighting.\n");
+        SHADERLIGHTING = false;
+        return;
+    }
+
+    UseProgram(LightingProgram);
+    glUniform1i(glGetUniformLocation(LightingProgram, "Texture"), 0);
+    glUniform1i(glGetUniformLocation(LightingProgram, "Lit"), 1);
+    UseProgram(0);
+
+    // Instanced variant, the mat4 takes 4 attribute slots and the mat3 the next 3
+    const char* attributes[2] = {"InstanceModel", "InstanceNormalMatrix"};
+    GLuint locations[2] = {INSTANCEATTRIBUTE, INSTANCEATTRIBUTE + 4};
+    InstancedLightingProgram = CreateShaderProgramWithAttributes(ShaderHeader, InstancedLightingVertexShader, LightingFragmentShader, attributes, locations, 2);
+    if (InstancedLightingProgram == 0) {
+        printf("Instanced drawing unavailable, falling back to one draw per instance.\n");
+        return;
+    }
+
+    UseProgram(InstancedLightingProgram);
+    glUniform1i(glGetUniformLocation(InstancedLightingProgram, "Texture"), 0);
+    UseProgram(0);
+
+    glGenBuffers(1, &InstanceBuffer);
+}
+
+
+// The layered programs are needed whenever array textures are drawn, whatever the lighting mode
+void InitTextureArrays() {
+    if (!TEXTUREARRAYS) {
+        return;
+    }
+
+    const char* attributes[3] = {"Layer", "InstanceModel", "InstanceNormalMatrix"};
+    GLuint locations[3] = {LAYERATTRIBUTE, INSTANCEATTRIBUTE, INSTANCEATTRIBUTE + 4};
+    LayeredLightingProgram = CreateShaderProgramWithAttributes(LayeredShaderHeader, LightingVertexShader, LightingFragmentShader, attributes, locations, 1);
+    InstancedLayeredLightingProgram = CreateShaderProgramWithAttributes(LayeredShaderHeader, InstancedLightingVertexShader, LightingFragmentShader, attributes, locations, 3);
+    if (LayeredLightingProgram == 0 || InstancedLayeredLightingProgram == 0) {
+        printf("Array textures unavailable, loading every texture on its own.\n");
+        glDeleteProgram(LayeredLightingProgram);
+        glDeleteProgram(InstancedLayeredLightingProgram);
+        LayeredLightingProgram = 0;
+        InstancedLayeredLightingProgram = 0;
+        TEXTUREARRAYS = false;
+        return;
+    }
+
+    GLuint programs[2] = {LayeredLightingProgram, InstancedLayeredLightingProgram};
+    for (int i = 0; i < 2; i++) {
+        UseProgram(programs[i]);
+        glUniform1i(glGetUniformLocation(programs[i], "Texture"), 0);
+    }
+    UseProgram(0);
+
+    // The instanced draws stream their matrices through the same buffer as the plain ones
+    if (InstanceBuffer == 0) {
+        glGenBuffers(1, &InstanceBuffer);
+    }
+}
+
+
+void UploadShaderLights(GLuint program, struct Light* lights, int lightcount) {
+    if (lightcount > MAXSHADERLIGHTS) {
+        lightcount = MAXSHADERLIGHTS;
+    }
+
+    GLfloat positions[MAXSHADERLIGHTS * 3];
+    GLfloat colors[MAXSHADERLIGHTS * 3];
+    GLfloat intensities[MAXSHADERLIGHTS];
+
+    for (int i = 0; i < lightcount; i++) {
+        positions[i * 3 + 0] = lights[i].position.x;
+        positions[i * 3 + 1] = lights[i].position.y;
+        positions[i * 3 + 2] = lights[i].position.z;
+        colors[i * 3 + 0] = lights[i].color.r;
+        colors[i * 3 + 1] = lights[i].color.g;
+        colors[i * 3 + 2] = lights[i].color.b;
+        intensities[i] = lights[i].intensity;
+    }
+
+    // Expects program to be bound
+    glUniform1i(glGetUniformLocation(program, "LightCount"), lightcount);
+    if (lightcount > 0) {
+        glUniform3fv(glGetUniformLocation(program, "LightPositions"), lightcount, positions);
+        glUniform3fv(glGetUniformLocation(program, "LightColors"), lightcount, colors);
+        glUniform1fv(glGetUniformLocation(program, "LightIntensities"), lightcount, intensities);
+    }
+}
+
+
+void UpperMatrix3(const struct mat4* source, GLfloat matrix[9]) {
+    // Upper left 3x3, for glUniformMatrix3fv and mat3 attributes
+    for (int column = 0; column < 3; column++) {
+        for (int row = 0; row < 3; row++) {
+            matrix[column * 3 + row] = source->m[column * 4 + row];
+        }
+    }
+}
+
+void LoadMultipleTextures(int numTextures, const char** filenames) {
+    if (numTextures <= 0) return;
+    AddTextureSlots(numTextures);
+
+    // The names are valid right away, the images arrive over the next frames
+    for (int i = 0; i < numTextures; ++i) {
+        TextureIDs[TextureCount + i] = AcquireTexture(filenames[i]);
+        TextureLayers[TextureCount + i] = -1;
+        if (TextureIDs[TextureCount + i] == 0) {
+            printf("Error: Failed to load texture %s\n", filenames[i]);
+        }
+    }
+
+    TextureCount += numTextures;
+}
+
+
+void AccumulateShade(struct color* shades, unsigned int index, struct color Shade) {
+    // Alpha counts the contributions until FinishShades averages them
+    shades[index].r += Shade.r;
+    shades[index].g += Shade.g;
+    shades[index].b += Shade.b;
+    shades[index].a += 1.0f;
+}
+
+
+void FinishShades(struct color* shades, int count) {
+    for (int i = 0; i < count; i++) {
+        struct color* shade = &shades[i];
+        if (shade->a > 0.0f) {
+            shade->r /= shade->a;
+            shade->g /= shade->a;
+            shade->b /= shade->a;
+        }
+        else {
+            // Only used by back faces, which never get drawn
+            shade->r = shade->g = shade->b = 0.05f;
+        }
+        shade->a = 1.0f;
+    }
+}
+
+
+// What the lighting jobs of one ShadeMesh call share
+struct ShadeMeshJob {
+    struct MeshLighting* scratch;
+    const struct object* Object;
+    struct mat4 model;
+    struct mat4 normalmatrix;
+    struct vector3 eye;
+};
+
+
+// Lights the front facing triangles of [start, end). They are packed to the front of the
+// range in the scratch arrays and faces marks the unused rest with -1.
+void ShadeTriangleRange(void* data, int start, int end) {
+    struct ShadeMeshJob* job = (struct ShadeMeshJob*)data;
+    struct MeshLighting* scratch = job->scratch;
+    struct ShadeBatch* batch = &scratch->shades;
+    int count = end - start;
+
+    // Move the precomputed normals and centers into world space
+    TransformDirections(&job->normalmatrix, job->Object->facenormals + start, scratch->normals + start, count);
+    TransformPoints(&job->model, job->Object->centroids + start, scratch->centers + start, count);
+
+    // Only triangles facing the camera go into the lighting batch
+    int facing = start;
+    for (int i = start; i < end; i++) {
+        struct vector3 normal = scratch->normals[i];
+        struct vector3 center = scratch->centers[i];
+
+        if (CPUBACKFACECULL) {
+            struct vector3 toeye = {job->eye.x - center.x, job->eye.y - center.y, job->eye.z - center.z};
+            if (dotProduct(normal, toeye) <= 0.0f) {
+                continue;
+            }
+        }
+
+        // The normal matrix keeps the direction but not the length when the mesh is scaled.
+        // It also keeps the normal pointing outwards for mirrored meshes, only their winding flips.
+        normal = normalize(normal);
+
+        scratch->faces[facing] = i;
+        batch->nx[facing] = normal.x;
+        batch->ny[facing] = normal.y;
+        batch->nz[facing] = normal.z;
+        batch->cx[facing] = center.x;
+        batch->cy[facing] = center.y;
+        batch->cz[facing] = center.z;
+        facing++;
+    }
+    for (int i = facing; i < end; i++) {
+        scratch->faces[i] = -1;
+    }
+
+    // Compute the shading of every front facing triangle of the range against every light in one go
+    struct ShadeBatch range = {
+        .count = facing - start,
+        .nx = batch->nx + start, .ny = batch->ny + start, .nz = batch->nz + start,
+        .cx = batch->cx + start, .cy = batch->cy + start, .cz = batch->cz + start,
+        .r = batch->r + start, .g = batch->g + start, .b = batch->b + start
+    };
+    LambertianDiffuseBatch(&range, &scratch->lights);
+}
+
+
+// Lights every vertex of a mesh on the CPU and writes the averaged colors to shades.
+// Big meshes are lit in SHADEJOBGRAIN sized triangle ranges on the job system.
+void ShadeMesh(struct MeshLighting* scratch, const struct object* Object, struct Transform transform, struct vector3 eye, struct Light* lights, int lightcount, struct color* shades) {
+    int Trianglenum = Object->trianglenum;
+
+    ReserveShadeBatch(&scratch->shades, &scratch->shadecapacity, Trianglenum);
+    FillLightBatch(&scratch->lights, &scratch->lightcapacity, lights, lightcount);
+
+    if (Trianglenum > scratch->facecapacity) {
+        scratch->normals = (struct vector3*)realloc(scratch->normals, Trianglenum * sizeof(struct vector3));
+        scratch->centers = (struct vector3*)realloc(scratch->centers, Trianglenum * sizeof(struct vector3));
+        scratch->faces = (int*)realloc(scratch->faces, Trianglenum * sizeof(int));
+        if (scratch->normals == NULL || scratch->centers == NULL || scratch->faces == NULL) {
+            printf("Memory allocation failed for mesh lighting\n");
+            exit(1);
+        }
+        scratch->facecapacity = Trianglenum;
+    }
+
+    struct ShadeMeshJob job = {
+        .scratch = scratch,
+        .Object = Object,
+        .model = TransformMatrix(transform),
+        .normalmatrix = NormalMatrix(transform),
+        .eye = eye
+    };
+    ParallelFor(ShadeTriangleRange, &job, Trianglenum, SHADEJOBGRAIN);
+
+    // Shared vertices get the average shade of the triangles using them, gathered in
+    // triangle order so the result does not depend on how the ranges were split
+    for (int i = 0; i < Object->vertexnum; i++) {
+        shades[i] = (struct color){0.0f, 0.0f, 0.0f, 0.0f};
+    }
+
+    struct ShadeBatch* batch = &scratch->shades;
+    for (int f = 0; f < Trianglenum; f++) {
+        int i = scratch->faces[f];
+        if (i < 0) {
+            continue;
+        }
+        struct color Shade = {batch->r[f], batch->g[f], batch->b[f], 1.0f};
+
+        AccumulateShade(shades, ObjectIndex(Object, i * 3 + 0), Shade);
+        AccumulateShade(shades, ObjectIndex(Object, i * 3 + 1), Shade);
+        AccumulateShade(shades, ObjectIndex(Object, i * 3 + 2), Shade);
+    }
+    FinishShades(shades, Object->vertexnum);
+}
+
+
+// Like DrawMeshUnculled, but with CPU lighting it can take already computed vertex shades, and
+// TextureID can be an array texture drawn at the given layer, -1 for a plain 2D texture
+void DrawMeshUnculledEx(struct object Object, struct Transform transform, GLuint TextureID, int layer, struct Light *lights, int lightcount, bool flatshaded, const struct color* shades) {
+    // Turn the transform into matrices once for the whole mesh
+    struct mat4 model = TransformMatrix(transform);
+    struct mat4 normalmatrix = NormalMatrix(transform);
+
+    // Push a matrix and apply the transformation
+    glPushMatrix();
+    glMultMatrixf(model.m);
+    glFrontFace(TransformMirrored(transform) ? GL_CW : GL_CCW);
+
+    // The whole mesh uses one texture, so bind it once. Fixed function can not sample array
+    // textures, so those always go through the layered program, lit or not.
+    bool layered = layer >= 0;
+    if (layered) {
+        BindTextureArray(TextureID);
+        glVertexAttrib1f(LAYERATTRIBUTE, (GLfloat)layer);
+    }
+    else {
+        BindTexture(TextureID);
+    }
+    glBindVertexArray(Object.vao);
+
+    if (!flatshaded && SHADERLIGHTING) {
+        // Diffuse and attenuation are evaluated per fragment on the GPU
+        GLfloat normals[9];
+        UpperMatrix3(&normalmatrix, normals);
+
+        GLuint program = layered ? LayeredLightingProgram : LightingProgram;
+        UseProgram(program);
+        glUniformMatrix4fv(glGetUniformLocation(program, "Model"), 1, GL_FALSE, model.m);
+        glUniformMatrix3fv(glGetUniformLocation(program, "NormalMatrix"), 1, GL_FALSE, normals);
+        if (layered) {
+            glUniform1i(glGetUniformLocation(program, "Lit"), 1);
+        }
+        UploadShaderLights(program, lights, lightcount);
+        glDisableClientState(GL_COLOR_ARRAY);
+    }
+    else if (!flatshaded) {
+        UseProgram(layered ? LayeredLightingProgram : 0);
+        if (layered) {
+            glUniform1i(glGetUniformLocation(LayeredLightingProgram, "Lit"), 0);
+        }
+
+        // Shades computed elsewhere, e.g. on the simulation thread, only need uploading
+        if (shades == NULL) {
+            long long lightingstart = ProfileBegin();
+            struct vector3 eye = {camerapos.px, camerapos.py, camerapos.pz};
+            ShadeMesh(&RenderLighting, &Object, transform, eye, lights, lightcount, Object.shades);
+            ProfileEnd(PROFILE_LIGHTING, lightingstart);
+            shades = Object.shades;
+        }
+
+        // Stream the new shading to the GPU and let the color array drive glColor
+        glBindBuffer(GL_ARRAY_BUFFER, Object.colorvbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, Object.vertexnum * sizeof(struct color), shades);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glEnableClientState(GL_COLOR_ARRAY);
+    }
+    else {
+        UseProgram(layered ? LayeredLightingProgram : 0);
+        if (layered) {
+            glUniform1i(glGetUniformLocation(LayeredLightingProgram, "Lit"), 0);
+        }
+        glDisableClientState(GL_COLOR_ARRAY);
+        glColor4f(WHITE.r, WHITE.g, WHITE.b, WHITE.a);
+    }
+
+    // Draw the whole mesh in one call
+    if (Object.indexnum > 0) {
+        glDrawElements(GL_TRIANGLES, Object.indexnum, Object.indextype, (void*)0);
+    }
+    else {
+        glDrawArrays(GL_TRIANGLES, 0, Object.vertexnum);
+    }
+    glBindVertexArray(0);
+
+    // Pop the matrix to avoid the current transform affecting other meshes
+    glPopMatrix();
+}
+
+
+void DrawMeshUnculled(struct object Object, struct Transform transform, GLuint TextureID, struct Light *lights, int lightcount, bool flatshaded) {
+    DrawMeshUnculledEx(Object, transform, TextureID, -1, lights, lightcount, flatshaded, NULL);
+}
+
+
+void DrawMesh(struct object Object, struct Transform transform, GLuint TextureID, struct Light *lights, int lightcount, bool flatshaded) {
+    // Off screen objects skip the lighting and the draw entirely
+    if (!ObjectVisible(&Object, transform)) {
+        return;
+    }
+    DrawMeshUnculled(Object, transform, TextureID, lights, lightcount, flatshaded);
+}
+
+
+// Per-instance data streamed to InstanceBuffer, read through generic attributes
+struct InstanceData {
+    GLfloat model[16];
+    GLfloat normalmatrix[9];
+    GLfloat layer;
+};
+
+
+// Draws instancecount copies of a mesh with one draw call, the transforms have already been culled.
+// With layers TextureID is an array texture and every copy samples its own layer of it.
+void DrawMeshInstancedUnculled(struct object Object, struct Transform* transforms, const int* layers, int instancecount, GLuint TextureID, struct Light *lights, int lightcount, bool flatshaded) {
+    if (instancecount <= 0) {
+        return;
+    }
+
+    // Without shaders, or with CPU lighting where every copy needs its own colors, draw them one by one
+    GLuint program = layers != NULL ? InstancedLayeredLightingProgram : InstancedLightingProgram;
+    if (program == 0 || (!flatshaded && !SHADERLIGHTING)) {
+        for (int i = 0; i < instancecount; i++) {
+            DrawMeshUnculledEx(Object, transforms[i], TextureID, layers != NULL ? layers[i] : -1, lights, lightcount, flatshaded, NULL);
+        }
+        return;
+    }
+
+    struct InstanceData* instances = (struct InstanceData*)malloc(instancecount * sizeof(struct InstanceData));
+    if (instances == NULL) {
+        printf("Memory allocation failed for instance data\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < instancecount; i++) {
+        struct mat4 model = TransformMatrix(transforms[i]);
+        struct mat4 normalmatrix = NormalMatrix(transforms[i]);
+
+        memcpy(instances[i].model, model.m, sizeof(model.m));
+        UpperMatrix3(&normalmatrix, instances[i].normalmatrix);
+        instances[i].layer = layers != NULL ? (GLfloat)layers[i] : 0.0f;
+    }
+
+    // Orphan the old storage so the driver does not have to wait for the last frame's draws
+    glBindBuffer(GL_ARRAY_BUFFER, InstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, instancecount * sizeof(struct InstanceData), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, instancecount * sizeof(struct InstanceData), instances);
+    free(instances);
+
+    if (layers != NULL) {
+        BindTextureArray(TextureID);
+    }
+    else {
+        BindTexture(TextureID);
+    }
+    glBindVertexArray(Object.vao);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glColor4f(WHITE.r, WHITE.g, WHITE.b, WHITE.a);
+
+    // All copies must share the mirroring of the first one, the render queue keeps them apart
+    glFrontFace(TransformMirrored(transforms[0]) ? GL_CW : GL_CCW);
+
+    // Columns of the two matrices advance once per instance instead of once per vertex
+    for (int column = 0; column < 4; column++) {
+        GLuint location = INSTANCEATTRIBUTE + column;
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(struct InstanceData),
+                              (void*)(offsetof(struct InstanceData, model) + column * 4 * sizeof(GLfloat)));
+        glVertexAttribDivisor(location, 1);
+    }
+    for (int column = 0; column < 3; column++) {
+        GLuint location = INSTANCEATTRIBUTE + 4 + column;
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, sizeof(struct InstanceData),
+                              (void*)(offsetof(struct InstanceData, normalmatrix) + column * 3 * sizeof(GLfloat)));
+        glVertexAttribDivisor(location, 1);
+    }
+    if (layers != NULL) {
+        glEnableVertexAttribArray(LAYERATTRIBUTE);
+        glVertexAttribPointer(LAYERATTRIBUTE, 1, GL_FLOAT, GL_FALSE, sizeof(struct InstanceData), (void*)offsetof(struct InstanceData, layer));
+        glVertexAttribDivisor(LAYERATTRIBUTE, 1);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    UseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "Lit"), !flatshaded);
+    if (!flatshaded) {
+        UploadShaderLights(program, lights, lightcount);
+    }
+
+    if (Object.indexnum > 0) {
+        glDrawElementsInstanced(GL_TRIANGLES, Object.indexnum, Object.indextype, (void*)0, instancecount);
+    }
+    else {
+        glDrawArraysInstanced(GL_TRIANGLES, 0, Object.vertexnum, instancecount);
+    }
+
+    // Leave the VAO as DrawMesh expects it
+    for (int location = INSTANCEATTRIBUTE; location < INSTANCEATTRIBUTE + 7; location++) {
+        glDisableVertexAttribArray(location);
+    }
+    if (layers != NULL) {
+        // The divisor is VAO state too, a plain draw sets the layer as a constant attribute
+        glVertexAttribDivisor(LAYERATTRIBUTE, 0);
+        glDisableVertexAttribArray(LAYERATTRIBUTE);
+    }
+    glBindVertexArray(0);
+}
+
+
+// Draws instancecount copies of a mesh with one draw call, one transform per copy
+void DrawMeshInstanced(struct object Object, struct Transform* transforms, int instancecount, GLuint TextureID, struct Light *lights, int lightcount, bool flatshaded) {
+    struct Transform* visible = (struct Transform*)malloc(instancecount * sizeof(struct Transform));
+    if (visible == NULL) {
+        printf("Memory allocation failed for instance culling\n");
+        exit(1);
+    }
+
+    int visiblecount = 0;
+    for (int i = 0; i < instancecount; i++) {
+        if (ObjectVisible(&Object, transforms[i])) {
+            visible[visiblecount++] = transforms[i];
+        }
+    }
+
+    DrawMeshInstancedUnculled(Object, visible, NULL, visiblecount, TextureID, lights, lightcount, flatshaded);
+    free(visible);
+}
+
+
+// One draw request collected by the render queue
+struct RenderCommand {
+    unsigned long long key;
+    int order;                  // Submission order, keeps the sort stable
+    struct object* mesh;
+    struct Transform transform;
+    GLuint texture;
+    int layer;                  // Layer of an array texture, -1 for a plain 2D texture
+    bool flatshaded;
+    const struct color* shades; // CPU lighting computed ahead of time, NULL to light it when drawn
+};
+
+
+struct RenderQueue {
+    struct RenderCommand* commands;
+    int count;
+    int capacity;
+
+    // Per batch transforms and layers handed to the instanced draw, grown to the longest run
+    struct Transform* transforms;
+    int* layers;
+    int batchcapacity;
+
+    // Results of the last RenderQueueFlush
+    int batches;        // Runs of identical state, each one instanced draw
+    int binds;          // Texture and program binds that reached the driver
+    int savedbinds;     // Binds avoided compared to submitting every command on its own
+    int culled;         // Commands rejected by the frustum test since the last flush
+    int lastculled;     // Commands culled in the frame the last flush drew
+};
+
+
+// Sort key, most expensive state change in the highest bits:
+// shading mode (program) | winding | layered | texture | mesh (VAO)
+// The layer of an array texture is left out, copies drawing different layers share a batch.
+unsigned long long RenderKey(struct object* mesh, GLuint texture, bool layered, bool flatshaded, bool mirrored) {
+    return ((unsigned long long)(flatshaded ? 1 : 0) << 63) |
+           ((unsigned long long)(mirrored ? 1 : 0) << 62) |
+           ((unsigned long long)(layered ? 1 : 0) << 61) |
+           ((unsigned long long)(texture & 0x1FFFFFFF) << 32) |
+           (unsigned long long)mesh->vao;
+}
+
+
+// layer is the layer of an array texture, -1 for a plain 2D texture
+void RenderQueueSubmit(struct RenderQueue* queue, struct object* mesh, struct Transform transform, GLuint texture, int layer, bool flatshaded) {
+    // Culled objects never enter the queue, so they cost neither lighting nor submission
+    if (!ObjectVisible(mesh, transform)) {
+        queue->culled++;
+        return;
+    }
+
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : 64;
+        struct RenderCommand* grown = (struct RenderCommand*)realloc(queue->commands, capacity * sizeof(struct RenderCommand));
+        if (grown == NULL) {
+            printf("Memory allocation failed for the render queue\n");
+            exit(1);
+        }
+        queue->commands = grown;
+        queue->capacity = capacity;
+    }
+
+    struct RenderCommand* command = &queue->commands[queue->count];
+    command->key = RenderKey(mesh, texture, layer >= 0, flatshaded, TransformMirrored(transform));
+    command->order = queue->count;
+    command->mesh = mesh;
+    command->transform = transform;
+    command->texture = texture;
+    command->layer = layer;
+    command->flatshaded = flatshaded;
+    command->shades = NULL;
+    queue->count++;
+}
+
+
+// Queues a mesh whose CPU lighting is already done, shades must stay valid until the flush
+void RenderQueueSubmitShaded(struct RenderQueue* queue, struct object* mesh, struct Transform transform, GLuint texture, int layer, const struct color* shades) {
+    int count = queue->count;
+    RenderQueueSubmit(queue, mesh, transform, texture, layer, false);
+    if (queue->count > count) {
+        queue->commands[count].shades = shades;
+    }
+}
+
+
+int CompareRenderCommands(const void* a, const void* b) {
+    const struct RenderCommand* A = (const struct RenderCommand*)a;
+    const struct RenderCommand* B = (const struct RenderCommand*)b;
+    if (A->key != B->key) {
+        return A->key < B->key ? -1 : 1;
+    }
+    return A->order - B->order;
+}
+
+
+// Sorts the frame's commands by state and draws them, runs of the same mesh become one instanced draw
+void RenderQueueFlush(struct RenderQueue* queue, struct Light* lights, int lightcount) {
+    qsort(queue->commands, queue->count, sizeof(struct RenderCommand), CompareRenderCommands);
+
+    struct BindStats before = BINDSTATS;
+    queue->batches = 0;
+    GpuTimerStamp();
+
+    for (int start = 0; start < queue->count; ) {
+        int end = start + 1;
+        while (end < queue->count && queue->commands[end].key == queue->commands[start].key) {
+            end++;
+        }
+
+        int run = end - start;
+        if (run > queue->batchcapacity) {
+            queue->transforms = (struct Transform*)realloc(queue->transforms, run * sizeof(struct Transform));
+            queue->layers = (int*)realloc(queue->layers, run * sizeof(int));
+            if (queue->transforms == NULL || queue->layers == NULL) {
+                printf("Memory allocation failed for the render queue\n");
+                exit(1);
+            }
+            queue->batchcapacity = run;
+        }
+        for (int i = 0; i < run; i++) {
+            queue->transforms[i] = queue->commands[start + i].transform;
+            queue->layers[i] = queue->commands[start + i].layer;
+        }
+
+        // Every copy with precomputed lighting needs its own colors, so those are drawn one by one
+        struct RenderCommand* first = &queue->commands[start];
+        if (first->shades != NULL) {
+            for (int i = start; i < end; i++) {
+                struct RenderCommand* command = &queue->commands[i];
+                DrawMeshUnculledEx(*command->mesh, command->transform, command->texture, command->layer, lights, lightcount, false, command->shades);
+            }
+        }
+        else {
+            DrawMeshInstancedUnculled(*first->mesh, queue->transforms, first->layer >= 0 ? queue->layers : NULL, run, first->texture, lights, lightcount, first->flatshaded);
+        }
+        GpuTimerStamp();
+        queue->batches++;
+
+        start = end;
+    }
+
+    // Submitting each command on its own would bind a texture and a program every time
+    queue->binds = (BINDSTATS.texturebinds - before.texturebinds) + (BINDSTATS.programbinds - before.programbinds);
+    queue->savedbinds = queue->count * 2 - queue->binds;
+    queue->count = 0;
+    queue->lastculled = queue->culled;
+    queue->culled = 0;
+}
+
+
+void RenderQueueReport(struct RenderQueue* queue) {
+    printf("Render queue: %d batches, %d binds, %d binds saved, %d culled\n", queue->batches, queue->binds, queue->savedbinds, queue->lastculled);
+}
+
+
+void FreeRenderQueue(struct RenderQueue* queue) {
+    free(queue->commands);
+    free(queue->transforms);
+    free(queue->layers);
+    *queue = (struct RenderQueue){0};
+}
+
+
+// Everything a frame draws, built by BuildScene. With SIMULATIONTHREAD the simulation thread
+// fills one every step and hands it to the render thread through a triple buffer: one slot
+// is being written, one is being drawn and one holds the newest finished snapshot. Both
+// sides swap slots with a single atomic exchange, so neither ever waits for the other.
+#define MAXSCENEDRAWS 64
+#define SNAPSHOTFRESH 4     // Flag in SceneBuffer.ready, the render thread has not taken that slot yet
+
+struct SceneDraw {
+    struct object* mesh;
+    struct Transform previous;      // The frame is drawn in between the last two simulation steps
+    struct Transform current;
+    GLuint texture;
+    int layer;                      // Layer of an array texture, -1 for a plain 2D texture
+    bool flatshaded;
+    struct color* shades;           // CPU lighting for current, only filled on the simulation thread
+    bool lit;                       // shades are filled, false when the draw was culled or is flat
+    int shadecapacity;
+};
+
+struct SceneSnapshot {
+    struct Transform cameraprevious;
+    struct Transform cameracurrent;
+    long long steptime;             // Monotonic nanoseconds the current step belongs to
+    long long lightingtime;         // Nanoseconds the simulation thread spent lighting it
+    bool lit;                       // The shades of every non flat draw are filled
+    int count;
+    struct SceneDraw draws[MAXSCENEDRAWS];
+};
+
+struct SceneBuffer {
+    struct SceneSnapshot slots[3];
+    atomic_int ready;               // Newest finished slot, plus SNAPSHOTFRESH until it is taken
+    int writing;                    // Only used by the simulation thread
+    int reading;                    // Only used by the render thread
+};
+
+struct SceneBuffer scenebuffer = {.ready = 0, .writing = 1, .reading = 2};
+pthread_t SimulationThreadHandle;
+atomic_bool SimulationRunning = false;
+
+
+// Shades and texture handles stay with the slot, only the per step fields are set here
+void AddSceneDraw(struct SceneSnapshot* snapshot, struct object* mesh, struct Transform previous, struct Transform current, GLuint texture, int layer, bool flatshaded) {
+    if (snapshot->count == MAXSCENEDRAWS) {
+        printf("Too many draws in the scene, the limit is %d\n", MAXSCENEDRAWS);
+        return;
+    }
+
+    struct SceneDraw* draw = &snapshot->draws[snapshot->count++];
+    draw->mesh = mesh;
+    draw->previous = previous;
+    draw->current = current;
+    draw->texture = texture;
+    draw->layer = layer;
+    draw->flatshaded = flatshaded;
+}
+
+
+struct Transform CubeTransform(float angle) {
+    struct Transform transform = {
+        .px = 0.0f, .py = 0.0f, .pz = 0.0f,
+        .sx = 1.0f, .sy = 1.0f, .sz = 1.0f,
+        .rx = angle, .ry = angle, .rz = 0.0f // Rotate around X and Y axes
+    };
+    return transform;
+}
+
+
+// The scene of the last two simulation steps
+void BuildScene(struct SceneSnapshot* snapshot, struct SimulationState previous, struct SimulationState current) {
+    snapshot->count = 0;
+    snapshot->lit = false;
+    snapshot->cameraprevious = previous.camera;
+    snapshot->cameracurrent = current.camera;
+
+    // Three cubes, rotated apart from each other. They take turns on the loaded textures, so
+    // with an array texture the last two share a mesh and a texture but not a layer
+    float offsets[3] = {0.0f, 45.0f, 22.5f};
+    struct object* meshes[3] = {&objectptr[0], &objectptr[1], &objectptr[1]};
+    for (int i = 0; i < 3; i++) {
+        int slot = i % TextureCount;
+        AddSceneDraw(snapshot, meshes[i], CubeTransform(previous.angle + offsets[i]), CubeTransform(current.angle + offsets[i]), TextureIDs[slot], TextureLayers[slot], false);
+    }
+}
+
+
+struct SceneLightingJob {
+    struct SceneSnapshot* snapshot;
+    struct Frustum frustum;         // Of the snapshot camera, ViewFrustum belongs to the render thread
+    struct vector3 eye;
+    struct Light* lights;
+    int lightcount;
+    float alpha;
+};
+
+
+void LightSceneDraws(void* data, int start, int end) {
+    struct SceneLightingJob* job = (struct SceneLightingJob*)data;
+
+    for (int i = start; i < end; i++) {
+        struct SceneDraw* draw = &job->snapshot->draws[i];
+        struct Transform transform = LerpTransform(draw->previous, draw->current, job->alpha);
+        draw->lit = false;
+
+        // Meshes out of view are not lit, like DrawMesh skips them on the render thread
+        if (draw->flatshaded || !ObjectInFrustum(&job->frustum, draw->mesh, transform)) {
+            continue;
+        }
+
+        if (draw->mesh->vertexnum > draw->shadecapacity) {
+            draw->shades = (struct color*)realloc(draw->shades, draw->mesh->vertexnum * sizeof(struct color));
+            if (draw->shades == NULL) {
+                printf("Memory allocation failed for the scene lighting\n");
+                exit(1);
+            }
+            draw->shadecapacity = draw->mesh->vertexnum;
+        }
+
+        // Every draw has its own scratch, a job waiting for its triangle ranges may run another draw
+        ShadeMesh(&SceneLighting[i], draw->mesh, transform, job->eye, job->lights, job->lightcount, draw->shades);
+        draw->lit = true;
+    }
+}
+
+
+// Lights every draw between its two steps on the job system, the render thread only uploads the result
+void LightSceneSnapshot(struct SceneSnapshot* snapshot, struct Light* lights, int lightcount, float alpha) {
+    long long start = MonotonicNanoseconds();
+
+    // The camera of the snapshot, camerapos belongs to the render thread
+    struct Transform camera = LerpTransform(snapshot->cameraprevious, snapshot->cameracurrent, alpha);
+    struct SceneLightingJob job = {.snapshot = snapshot, .eye = {camera.px, camera.py, camera.pz},
+                                   .lights = lights, .lightcount = lightcount, .alpha = alpha};
+    BuildFrustum(&job.frustum, camera);
+    ParallelFor(LightSceneDraws, &job, snapshot->count, 1);
+
+    snapshot->lit = true;
+    snapshot->lightingtime = MonotonicNanoseconds() - start;
+}
+
+
+void PublishSceneSnapshot() {
+    int previous = atomic_exchange_explicit(&scenebuffer.ready, scenebuffer.writing | SNAPSHOTFRESH, memory_order_acq_rel);
+    scenebuffer.writing = previous & ~SNAPSHOTFRESH;
+}
+
+
+// Takes the newest snapshot if there is one, otherwise keeps drawing the last one
+struct SceneSnapshot* AcquireSceneSnapshot(bool* fresh) {
+    *fresh = (atomic_load_explicit(&scenebuffer.ready, memory_order_relaxed) & SNAPSHOTFRESH) != 0;
+    if (*fresh) {
+        int previous = atomic_exchange_explicit(&scenebuffer.ready, scenebuffer.reading, memory_order_acq_rel);
+        scenebuffer.reading = previous & ~SNAPSHOTFRESH;
+    }
+    return &scenebuffer.slots[scenebuffer.reading];
+}
+
+
+void* SimulationThread(void* unused) {
+    (void)unused;
+    struct SimulationState previous = currentstate;
+    struct SimulationState current = currentstate;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (atomic_load_explicit(&SimulationRunning, memory_order_relaxed)) {
+        // One step every SIMULATIONSTEP on an absolute schedule, like the frame pacing
+        next.tv_nsec += SIMULATIONSTEPNS;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        long long steptime = (long long)next.tv_sec * 1000000000LL + next.tv_nsec;
+        if (MonotonicNanoseconds() - steptime > 250000000LL) {
+            // Far behind, e.g. after the process was stopped, skip ahead instead of catching up
+            clock_gettime(CLOCK_MONOTONIC, &next);
+            steptime = (long long)next.tv_sec * 1000000000LL + next.tv_nsec;
+        }
+
+        previous = current;
+        UpdateSimulation(&current, SIMULATIONSTEP);
+
+        struct SceneSnapshot* snapshot = &scenebuffer.slots[scenebuffer.writing];
+        BuildScene(snapshot, previous, current);
+        snapshot->steptime = steptime;
+        snapshot->lightingtime = 0;
+        if (!SHADERLIGHTING) {
+            LightSceneSnapshot(snapshot, lightptr, LIGHTAMOUNT, 1.0f);
+        }
+        PublishSceneSnapshot();
+    }
+
+    return NULL;
+}
+
+
+void StartSimulationThread() {
+    // The render thread needs something to draw before the first step is published
+    struct SceneSnapshot* first = &scenebuffer.slots[scenebuffer.reading];
+    BuildScene(first, currentstate, currentstate);
+    first->steptime = MonotonicNanoseconds();
+    if (!SHADERLIGHTING) {
+        LightSceneSnapshot(first, lightptr, LIGHTAMOUNT, 1.0f);
+    }
+
+    atomic_store(&SimulationRunning, true);
+    if (pthread_create(&SimulationThreadHandle, NULL, SimulationThread, NULL) != 0) {
+        printf("Could not start the simulation thread, simulating on the render thread\n");
+        atomic_store(&SimulationRunning, false);
+    }
+}
+
+
+void StopSimulationThread() {
+    if (!atomic_load(&SimulationRunning)) {
+        return;
+    }
+    atomic_store(&SimulationRunning, false);
+    pthread_join(SimulationThreadHandle, NULL);
+
+    for (int slot = 0; slot < 3; slot++) {
+        for (int i = 0; i < MAXSCENEDRAWS; i++) {
+            free(scenebuffer.slots[slot].draws[i].shades);
+            scenebuffer.slots[slot].draws[i].shades = NULL;
+            scenebuffer.slots[slot].draws[i].shadecapacity = 0;
+        }
+    }
+}
+
+// Camera path recording and replay. A recording holds the camera and the transform of every
+// scene draw exactly as they were drawn in each frame, plus the Random() seed of the run. A
+// replay draws those frames again one by one with a fixed frame time, so two builds render
+// the same frames and their timings can be compared. The format is plain text:
+//   CALIUMPATH 1
+//   seed <seed>
+//   frame <index> <draws>
+//   camera <px py pz sx sy sz rx ry rz>
+//   draw <px py pz sx sy sz rx ry rz>      once per draw
+#define CAMERAPATHVERSION 1
+
+struct CameraPathFrame {
+    struct Transform camera;
+    int first;                      // Index of the first draw in CameraPath.draws
+    int count;
+};
+
+struct CameraPath {
+    FILE* record;
+    int recorded;                   // Frames written so far
+
+    struct CameraPathFrame* frames;
+    struct Transform* draws;
+    int framecount;
+    int drawcount;
+    int next;                       // Frame the replay draws next
+};
+
+struct CameraPath camerapath = {0};
+
+
+void WriteTransform(FILE* file, const char* tag, struct Transform t) {
+    // Nine significant digits bring every float back bit for bit
+    fprintf(file, "%s %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n",
+            tag, t.px, t.py, t.pz, t.sx, t.sy, t.sz, t.rx, t.ry, t.rz);
+}
+
+
+bool ReadTransform(FILE* file, const char* tag, struct Transform* t) {
+    char word[16];
+    return fscanf(file, "%15s %f %f %f %f %f %f %f %f %f", word,
+                  &t->px, &t->py, &t->pz, &t->sx, &t->sy, &t->sz, &t->rx, &t->ry, &t->rz) == 10 &&
+           strcmp(word, tag) == 0;
+}
+
+
+bool StartRecording(const char* path) {
+    camerapath.record = fopen(path, "w");
+    if (camerapath.record == NULL) {
+        printf("Error opening %s for recording\n", path);
+        return false;
+    }
+    fprintf(camerapath.record, "CALIUMPATH %d\nseed %u\n", CAMERAPATHVERSION, RANDOMSEED);
+    return true;
+}
+
+
+void RecordFrame(struct Transform camera, const struct SceneSnapshot* snapshot, float alpha) {
+    if (camerapath.record == NULL) {
+        return;
+    }
+
+    fprintf(camerapath.record, "frame %d %d\n", camerapath.recorded++, snapshot->count);
+    WriteTransform(camerapath.record, "camera", camera);
+    for (int i = 0; i < snapshot->count; i++) {
+        const struct SceneDraw* draw = &snapshot->draws[i];
+        WriteTransform(camerapath.record, "draw", LerpTransform(draw->previous, draw->current, alpha));
+    }
+}
+
+
+// Reads a whole recording and sets RANDOMSEED to the one it was made with
+bool LoadCameraPath(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Error opening camera path %s\n", path);
+        return false;
+    }
+
+    int version = 0;
+    if (fscanf(file, "CALIUMPATH %d seed %u", &version, &RANDOMSEED) != 2 || version != CAMERAPATHVERSION) {
+        printf("%s is not a version %d camera path\n", path, CAMERAPATHVERSION);
+        fclose(file);
+        return false;
+    }
+
+    int framecapacity = 0, drawcapacity = 0;
+    int index, count;
+    while (fscanf(file, " frame %d %d", &index, &count) == 2) {
+        if (count < 0 || count > MAXSCENEDRAWS) {
+            printf("Frame %d of %s has %d draws, the limit is %d\n", index, path, count, MAXSCENEDRAWS);
+            fclose(file);
+            return false;
+        }
+
+        if (camerapath.framecount == framecapacity) {
+            framecapacity = framecapacity == 0 ? 256 : framecapacity * 2;
+            camerapath.frames = (struct CameraPathFrame*)realloc(camerapath.frames, framecapacity * sizeof(struct CameraPathFrame));
+        }
+        if (camerapath.drawcount + count > drawcapacity) {
+            drawcapacity = drawcapacity == 0 ? 1024 : drawcapacity * 2;
+            drawcapacity = drawcapacity < camerapath.drawcount + count ? camerapath.drawcount + count : drawcapacity;
+            camerapath.draws = (struct Transform*)realloc(camerapath.draws, drawcapacity * sizeof(struct Transform));
+        }
+        if (camerapath.frames == NULL || camerapath.draws == NULL) {
+            printf("Memory allocation failed for the camera path\n");
+            exit(1);
+        }
+
+        struct CameraPathFrame* frame = &camerapath.frames[camerapath.framecount];
+        frame->first = camerapath.drawcount;
+        frame->count = count;
+        bool valid = ReadTransform(file, "camera", &frame->camera);
+        for (int i = 0; i < count && valid; i++) {
+            valid = ReadTransform(file, "draw", &camerapath.draws[frame->first + i]);
+        }
+        if (!valid) {
+            printf("Frame %d of %s is cut off or malformed\n", index, path);
+            fclose(file);
+            return false;
+        }
+
+        camerapath.framecount++;
+        camerapath.drawcount += count;
+    }
+
+    fclose(file);
+    printf("Loaded %d frames from %s, seed %u\n", camerapath.framecount, path, RANDOMSEED);
+    return true;
+}
+
+
+// Puts the recorded transforms of the next frame into the snapshot, on both steps so any
+// alpha gives the recorded values. Returns false once every frame was replayed.
+bool ReplayFrame(struct SceneSnapshot* snapshot) {
+    if (camerapath.next >= camerapath.framecount) {
+        return false;
+    }
+
+    struct CameraPathFrame* frame = &camerapath.frames[camerapath.next++];
+    snapshot->cameraprevious = frame->camera;
+    snapshot->cameracurrent = frame->camera;
+
+    if (frame->count != snapshot->count) {
+        printf("Frame %d was recorded with %d draws, the scene has %d\n", camerapath.next - 1, frame->count, snapshot->count);
+    }
+    int count = frame->count < snapshot->count ? frame->count : snapshot->count;
+    for (int i = 0; i < count; i++) {
+        snapshot->draws[i].previous = camerapath.draws[frame->first + i];
+        snapshot->draws[i].current = camerapath.draws[frame->first + i];
+    }
+    return true;
+}
+
+
+void FreeCameraPath() {
+    if (camerapath.record != NULL) {
+        fclose(camerapath.record);
+    }
+    free(camerapath.frames);
+    free(camerapath.draws);
+    camerapath = (struct CameraPath){0};
+}
+
+
+// Profiler overlay, drawn with the bitmap font in fontspritesheet.png. The text is blitted
+// into a small texture whenever it changes, so every frame only draws a single quad.
+#define HUDCOLUMNS 32
+#define HUDROWS 8
+
+struct HudVertex {
+    float x, y;
+    float u, v;
+};
+
+unsigned char* FontPixels = NULL;   // Alpha of the font sheet, top row first
+int FontWidth = 0;
+int FontHeight = 0;
+
+unsigned char HudPixels[HUDROWS * 8][HUDCOLUMNS * 8][4];
+GLuint HudTexture = 0;
+GLuint HudVAO = 0;
+GLuint HudVBO = 0;
+
+
+// Finds the 8x8 cell of a character in the font sheet, returns false for characters it does not have
+bool FontGlyph(char c, int* column, int* row) {
+    if (c >= 'a' && c <= 'z') {
+        c = c - 'a' + 'A';
+    }
+
+    if (c >= 'A' && c <= 'Z') {
+        *column = c - 'A';
+        *row = 0;
+        return true;
+    }
+
+    // The digits start at 1, 0 comes after 9
+    *row = 1;
+    if (c >= '1' && c <= '9') {
+        *column = c - '1';
+        return true;
+    }
+    switch (c) {
+        case '0': *column = 9; return true;
+        case '+': *column = 10; return true;
+        case '-': *column = 11; return true;
+        case ':': *column = 17; return true;
+        case '.': *column = 18; return true;
+        case ',': *column = 19; return true;
+    }
+    return false;
+}
+
+
+void InitHud() {
+    // Only the alpha is kept, the glyphs are black and get their color from the texture below
+    int channels;
+    stbi_set_flip_vertically_on_load(0);
+    unsigned char* img_data = stbi_load("fontspritesheet.png", &FontWidth, &FontHeight, &channels, 4);
+    if (img_data == NULL) {
+        printf("Error in loading font image: fontspritesheet.png\n");
+        PROFILERHUD = false;
+        return;
+    }
+
+    FontPixels = (unsigned char*)malloc(FontWidth * FontHeight);
+    if (FontPixels == NULL) {
+        printf("Memory allocation failed for the font\n");
+        exit(1);
+    }
+    for (int i = 0; i < FontWidth * FontHeight; i++) {
+        FontPixels[i] = img_data[i * 4 + 3];
+    }
+    stbi_image_free(img_data);
+
+    glGenTextures(1, &HudTexture);
+    BindTexture(HudTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, HUDCOLUMNS * 8, HUDROWS * 8, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    // One quad in pixel coordinates, the first texture row is the top line of text. The
+    // projection flips y, so this is counter clockwise on screen like everything else.
+    float x = 8.0f * HUDSCALE, y = 8.0f * HUDSCALE;
+    float w = HUDCOLUMNS * 8.0f * HUDSCALE, h = HUDROWS * 8.0f * HUDSCALE;
+    struct HudVertex quad[6] = {
+        {x, y + h, 0.0f, 1.0f}, {x + w, y + h, 1.0f, 1.0f}, {x + w, y, 1.0f, 0.0f},
+        {x, y + h, 0.0f, 1.0f}, {x + w, y, 1.0f, 0.0f}, {x, y, 0.0f, 0.0f},
+    };
+
+    glGenVertexArrays(1, &HudVAO);
+    glGenBuffers(1, &HudVBO);
+    glBindVertexArray(HudVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, HudVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(struct HudVertex), (void*)offsetof(struct HudVertex, x));
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(struct HudVertex), (void*)offsetof(struct HudVertex, u));
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-// Function to compute the normal vector of a triangle
-struct vector3 ComputeNormal(struct vector3 A, struct vector3 B, struct vector3 C, struct vector3 viewDir) {
-    // Compute the two edge vectors
-    struct vector3 AB = {B.x - A.x, B.y - A.y, B.z - A.z};
-    struct vector3 AC = {C.x - A.x, C.y - A.y, C.z - A.z};
-    
 
-    struct vector3 Center = {
-        (A.x + B.x + C.x) / 3,
-        (A.y + B.y + C.y) / 3,
-        (A.z + B.z + C.z) / 3
-    };
+// Copies the glyphs of text into HudPixels, anything past HUDCOLUMNS or HUDROWS is cut off
+void BlitHudText(const char* text, struct color tint) {
+    memset(HudPixels, 0, sizeof(HudPixels));
+    unsigned char r = (unsigned char)(tint.r * 255.0f);
+    unsigned char g = (unsigned char)(tint.g * 255.0f);
+    unsigned char b = (unsigned char)(tint.b * 255.0f);
 
-    // Compute the cross product of AB and AC
-    struct vector3 normal = crossProduct(AB, AC);
-    
-    // Normalize the normal vector
-    normal = normalize(normal);
-
-    // Determine if the normal is facing the correct direction
-    // If the dot product between the normal and the view direction is negative,
-    // the normal is facing away from the camera, so flip it
-    if (dotProduct(normal, viewDir) < 0.0f) {
-        normal.x = -normal.x;
-        normal.y = -normal.y;
-        normal.z = -normal.z;
-    }
-    
-    return normal;
+    int line = 0, column = 0;
+    for (const char* c = text; *c != '\0' && line < HUDROWS; c++) {
+        if (*c == '\n') {
+            line++;
+            column = 0;
+            continue;
+        }
+
+        int glyphcolumn, glyphrow;
+        if (column < HUDCOLUMNS && FontGlyph(*c, &glyphcolumn, &glyphrow)) {
+            for (int y = 0; y < 8; y++) {
+                const unsigned char* src = &FontPixels[(glyphrow * 8 + y) * FontWidth + glyphcolumn * 8];
+                unsigned char (*dst)[4] = HudPixels[line * 8 + y] + column * 8;
+                for (int x = 0; x < 8; x++) {
+                    dst[x][0] = r;
+                    dst[x][1] = g;
+                    dst[x][2] = b;
+                    dst[x][3] = src[x];
+                }
+            }
+        }
+        column++;
+    }
 }
 
 
-struct color LambertianDiffuse(struct vector3 normal, struct vector3 midpoint, struct Light* lights, int lightCount) {
-    struct color totalDiffuse = {0.0f, 0.0f, 0.0f, 1.0f}; // Initialize to black
+// Refreshes the statistics and the overlay texture, only every PROFILEREFRESH frames
+void UpdateHud() {
+    ProfileComputeStats();
 
-    // Loop through all the lights
-    for (int i = 0; i < lightCount; i++) {
-        // Vector from the midpoint to the light
-        struct vector3 lightDir = {lights[i].position.x - midpoint.x, 
-                                   lights[i].position.y - midpoint.y, 
-                                   lights[i].position.z - midpoint.z};
-        
-        // Calculate the distance between the midpoint and the light source
-        float distance = sqrt(lightDir.x * lightDir.x + lightDir.y * lightDir.y + lightDir.z * lightDir.z);
+    char text[HUDROWS * (HUDCOLUMNS + 1) + 1];
+    int length = snprintf(text, sizeof(text), "ZONE     MIN    AVG    P99\n");
+    for (int zone = 0; zone < PROFILEZONES && length < (int)sizeof(text); zone++) {
+        struct ProfileStats stats = profiler.stats[zone];
+        length += snprintf(text + length, sizeof(text) - length, "%-6s %6.3f %6.3f %6.3f\n",
+                           ProfileZoneNames[zone], stats.min, stats.avg, stats.p99);
+    }
 
-        // Normalize light direction
-        lightDir = normalize(lightDir); 
+    // Jitter of the present intervals and the frames of the ring that missed their deadline
+    FramePacingComputeStats();
+    if (length < (int)sizeof(text)) {
+        snprintf(text + length, sizeof(text) - length, "%-8s JIT %5.2f MISS %d\n",
+                 SwapIntervalName(SWAPINTERVAL), pacing.jitter, pacing.ringmissed);
+    }
 
-        // Calculate the Lambertian diffuse intensity (clamped to non-negative)
-        float diffuseIntensity = fmax(0.0f, dotProduct(normal, lightDir)) * lights->intensity;
+    BlitHudText(text, (struct color){1.0f, 1.0f, 0.0f, 1.0f});
+    // Respecifying the whole image lets the driver hand out new storage instead of
+    // waiting for frames still reading the old text
+    BindTexture(HudTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, HUDCOLUMNS * 8, HUDROWS * 8, 0, GL_RGBA, GL_UNSIGNED_BYTE, HudPixels);
+}
 
-        // Apply distance attenuation (inverse square law)
-        if (diffuseIntensity > 0.0f && distance > 0.0f) {
-            // Attenuate light intensity with distance
-            float attenuation = 1.0f / (distance * distance);
 
-            // Apply the attenuation and add the contribution of the current light source
-            totalDiffuse.r += diffuseIntensity * lights[i].color.r * attenuation;
-            totalDiffuse.g += diffuseIntensity * lights[i].color.g * attenuation;
-            totalDiffuse.b += diffuseIntensity * lights[i].color.b * attenuation;
-        }
+void DrawHud() {
+    static int frames = 0;
+    if (frames++ % PROFILEREFRESH == 0) {
+        UpdateHud();
     }
 
-    // Ensure the color components are clamped between 0 and 1
-    if (totalDiffuse.r > 1.0f) totalDiffuse.r = 1.0f;
-    if (totalDiffuse.g > 1.0f) totalDiffuse.g = 1.0f;
-    if (totalDiffuse.b > 1.0f) totalDiffuse.b = 1.0f;
+    // Pixel coordinates with the origin in the top left corner
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0.0, WIDTH, HEIGHT, 0.0, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
 
-    // Ensure the color components are above a certain threshold
-    if (totalDiffuse.r < 0.05f) totalDiffuse.r = 0.05f;
-    if (totalDiffuse.g < 0.05f) totalDiffuse.g = 0.05f;
-    if (totalDiffuse.b < 0.05f) totalDiffuse.b = 0.05f;
+    UseProgram(0);
+    BindTexture(HudTexture);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    return totalDiffuse;
+    glBindVertexArray(HudVAO);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    glBindVertexArray(0);
+
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
 }
 
 
-void LoadMultipleTextures(int numTextures, const char** filenames) {
-    if (numTextures <= 0) return;
+// Headless rendering, an EGL context without any window that draws into an FBO
+EGLDisplay HeadlessDisplay = EGL_NO_DISPLAY;
+EGLContext HeadlessContext = EGL_NO_CONTEXT;
+EGLSurface HeadlessSurface = EGL_NO_SURFACE;
+GLuint HeadlessFramebuffer = 0;
+GLuint HeadlessRenderbuffers[2] = {0, 0};
+int HeadlessFrame = 0;
 
-    GLuint* newTextureIDs = realloc(TextureIDs, numTextures * sizeof(GLuint));
-    if (newTextureIDs == NULL) {
-        printf("Failed to allocate memory for textures.\n");
-        exit(1);
+
+bool CreateHeadlessContext() {
+    // Mesa's surfaceless platform needs neither X nor a GPU, llvmpipe renders on the CPU
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != NULL) {
+        HeadlessDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+#endif
+    if (HeadlessDisplay == EGL_NO_DISPLAY || !eglInitialize(HeadlessDisplay, NULL, NULL)) {
+        HeadlessDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (HeadlessDisplay == EGL_NO_DISPLAY || !eglInitialize(HeadlessDisplay, NULL, NULL)) {
+            printf("Error: No EGL display available for headless rendering\n");
+            return false;
+        }
     }
-    TextureIDs = newTextureIDs;
 
-    for (int i = 0; i < numTextures; ++i) {
-        TextureIDs[i] = LoadTexture(filenames[i]);
-        if (TextureIDs[i] == 0) {
-            printf("Error: Failed to load texture %s\n", filenames[i]);
-        } else {
-            printf("Texture %s loaded successfully. ID: %u\n", filenames[i], TextureIDs[i]);
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        printf("Error: EGL does not support desktop OpenGL\n");
+        return false;
+    }
+
+    const EGLint configattributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config = NULL;
+    EGLint configcount = 0;
+    eglChooseConfig(HeadlessDisplay, configattributes, &config, 1, &configcount);
+    if (configcount == 0) {
+        config = NULL;  // Surfaceless contexts can do without a config
+    }
+
+    HeadlessContext = eglCreateContext(HeadlessDisplay, config, EGL_NO_CONTEXT, NULL);
+    if (HeadlessContext == EGL_NO_CONTEXT) {
+        printf("Error: Could not create an EGL context\n");
+        return false;
+    }
+
+    // Everything is drawn into our own FBO, so only fall back to a pbuffer when surfaceless is missing
+    if (!eglMakeCurrent(HeadlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, HeadlessContext)) {
+        const EGLint pbufferattributes[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+        if (config != NULL) {
+            HeadlessSurface = eglCreatePbufferSurface(HeadlessDisplay, config, pbufferattributes);
+        }
+        if (HeadlessSurface == EGL_NO_SURFACE ||
+            !eglMakeCurrent(HeadlessDisplay, HeadlessSurface, HeadlessSurface, HeadlessContext)) {
+            printf("Error: Could not make the EGL context current\n");
+            return false;
         }
     }
 
-    TextureCount += numTextures;
+    return true;
 }
 
 
-void DrawColoredTriangle(struct vertex vertices[3]){
-    struct vertex v1 = vertices[0];
-    struct vertex v2 = vertices[1];
-	struct vertex v3 = vertices[2];
+void CreateHeadlessFramebuffer() {
+    glGenFramebuffers(1, &HeadlessFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, HeadlessFramebuffer);
+    glGenRenderbuffers(2, HeadlessRenderbuffers);
 
-    glBegin(GL_TRIANGLES);	
-		glColor4f(v1.r, v1.g, v1.b, v1.a);
-		glVertex3f(v1.x, v1.y, v1.z);
+    glBindRenderbuffer(GL_RENDERBUFFER, HeadlessRenderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, WIDTH, HEIGHT);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, HeadlessRenderbuffers[0]);
 
-		glColor4f(v2.r, v2.g, v2.b, v2.a);
-		glVertex3f(v2.x, v2.y, v2.z);
+    glBindRenderbuffer(GL_RENDERBUFFER, HeadlessRenderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, WIDTH, HEIGHT);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, HeadlessRenderbuffers[1]);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
 
-		glColor4f(v3.r, v3.g, v3.b, v3.a);
-		glVertex3f(v3.x, v3.y, v3.z);
-    glEnd();
-
-	glutSwapBuffers();
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Error: Headless framebuffer is incomplete\n");
+        exit(1);
+    }
 
-    return;
+    // A surfaceless context starts with an empty viewport
+    glViewport(0, 0, WIDTH, HEIGHT);
 }
 
 
-float Random(){
-    float min = 0.0f;
-    float max = 1.0f;
+void DestroyHeadlessContext() {
+    if (HeadlessFramebuffer != 0) {
+        glDeleteFramebuffers(1, &HeadlessFramebuffer);
+        glDeleteRenderbuffers(2, HeadlessRenderbuffers);
+    }
 
-    // Generate a random floating-point number between min and max
-    float randomFloat = min + (float)rand() / RAND_MAX * (max - min);
-    return randomFloat;
+    eglMakeCurrent(HeadlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (HeadlessSurface != EGL_NO_SURFACE) {
+        eglDestroySurface(HeadlessDisplay, HeadlessSurface);
+    }
+    eglDestroyContext(HeadlessDisplay, HeadlessContext);
+    eglTerminate(HeadlessDisplay);
 }
 
 
-void DrawTriangle(struct Triangle triangle, GLuint TextureID, struct color Color) {//, struct Transform transform){
-    struct vertex v1 = triangle.v1;
-    struct vertex v2 = triangle.v2;
-	struct vertex v3 = triangle.v3;
+// CRC of PNG chunks, the table is built on first use
+unsigned int Crc32(unsigned int crc, const unsigned char* data, size_t length) {
+    static unsigned int table[256];
+    static bool tableready = false;
+    if (!tableready) {
+        for (unsigned int n = 0; n < 256; n++) {
+            unsigned int c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        tableready = true;
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
 
-    float rotation =22.5f;
+void WriteBigEndian32(unsigned char* out, unsigned int value) {
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char)value;
+}
 
-    //glPushMatrix();
 
-    //glTranslatef(transform.px, transform.py, transform.pz);
-    //glScalef(transform.sx, transform.sy, transform.sz);
+void WritePNGChunk(FILE* file, const char* type, const unsigned char* data, unsigned int length) {
+    unsigned char header[8];
+    WriteBigEndian32(header, length);
+    memcpy(header + 4, type, 4);
 
-	// Bind the texture
-	glBindTexture(GL_TEXTURE_2D, TextureID);
+    unsigned char footer[4];
+    WriteBigEndian32(footer, Crc32(Crc32(0, header + 4, 4), data, length));
 
-    glColor4f(Color.r, Color.g, Color.b, Color.a);
+    fwrite(header, 1, 8, file);
+    fwrite(data, 1, length, file);
+    fwrite(footer, 1, 4, file);
+}
 
-    glBegin(GL_TRIANGLES);
-        glTexCoord2f(v1.u, v1.v);
-		glVertex3f(v1.x, v1.y, v1.z);
 
-        glTexCoord2f(v2.u, v2.v);
-		glVertex3f(v2.x, v2.y, v2.z);
+// Writes an RGBA image, top row first. The pixels are stored without compression,
+// which keeps the writer small and fast enough to dump every frame.
+bool WritePNG(const char* filename, int width, int height, const unsigned char* rgba) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        printf("Error opening %s for writing\n", filename);
+        return false;
+    }
 
-        glTexCoord2f(v3.u, v3.v);
-		glVertex3f(v3.x, v3.y, v3.z);
-    glEnd();
+    // Every row starts with filter type 0, then goes into stored deflate blocks of at most 65535 bytes
+    size_t rowsize = (size_t)width * 4 + 1;
+    size_t rawsize = rowsize * height;
+    size_t blocks = (rawsize + 65534) / 65535;
+    size_t idatsize = 2 + rawsize + blocks * 5 + 4;
+    unsigned char* idat = (unsigned char*)malloc(idatsize);
+    if (idat == NULL) {
+        printf("Memory allocation failed for %s\n", filename);
+        fclose(file);
+        return false;
+    }
 
-    //glPopMatrix();
+    unsigned char* out = idat;
+    *out++ = 0x78;  // zlib header, deflate with a 32K window
+    *out++ = 0x01;
+
+    unsigned int adlera = 1, adlerb = 0;
+    size_t written = 0;
+    int row = 0;
+    size_t column = 0;
+    while (written < rawsize) {
+        unsigned int blocksize = rawsize - written < 65535 ? (unsigned int)(rawsize - written) : 65535;
+        *out++ = written + blocksize == rawsize;  // Final block flag, block type 0 is stored
+        *out++ = blocksize & 0xFF;
+        *out++ = blocksize >> 8;
+        *out++ = ~blocksize & 0xFF;
+        *out++ = (~blocksize >> 8) & 0xFF;
+
+        for (unsigned int i = 0; i < blocksize; i++) {
+            unsigned char byte = column == 0 ? 0 : rgba[(size_t)row * width * 4 + column - 1];
+            if (++column == rowsize) {
+                column = 0;
+                row++;
+            }
+            *out++ = byte;
+            adlera = (adlera + byte) % 65521;
+            adlerb = (adlerb + adlera) % 65521;
+        }
+        written += blocksize;
+    }
+    WriteBigEndian32(out, (adlerb << 16) | adlera);
+
+    unsigned char ihdr[13];
+    WriteBigEndian32(ihdr, width);
+    WriteBigEndian32(ihdr + 4, height);
+    ihdr[8] = 8;    // Bits per channel
+    ihdr[9] = 6;    // RGBA
+    ihdr[10] = 0;   // Deflate
+    ihdr[11] = 0;   // Adaptive filtering
+    ihdr[12] = 0;   // Not interlaced
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    fwrite(signature, 1, 8, file);
+    WritePNGChunk(file, "IHDR", ihdr, 13);
+    WritePNGChunk(file, "IDAT", idat, (unsigned int)idatsize);
+    WritePNGChunk(file, "IEND", NULL, 0);
+
+    free(idat);
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
 }
 
 
-struct vector3 angleToZero(struct vector3 position) {
-    float x = cos(position.x);
-    float z = cos(position.z);
-    float y = sin(position.y);
+// Reads the finished frame back and writes it as a PNG
+void DumpFrame(int frame) {
+    static unsigned char* pixels = NULL;
+    static unsigned char* flipped = NULL;
+    size_t rowsize = (size_t)WIDTH * 4;
+    if (pixels == NULL) {
+        pixels = (unsigned char*)malloc(rowsize * HEIGHT);
+        flipped = (unsigned char*)malloc(rowsize * HEIGHT);
+        if (pixels == NULL || flipped == NULL) {
+            printf("Memory allocation failed for the frame dump\n");
+            exit(1);
+        }
+    }
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+
+    // GL returns the bottom row first, PNG wants the top one
+    for (int y = 0; y < HEIGHT; y++) {
+        memcpy(flipped + y * rowsize, pixels + (HEIGHT - 1 - y) * rowsize, rowsize);
+    }
 
-    return (struct vector3){x, y, z};
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s%05d.png", FRAMEDUMPPREFIX, frame);
+    WritePNG(filename, WIDTH, HEIGHT, flipped);
 }
 
 
-void DrawMesh(struct object Object, struct Transform transform, GLuint TextureID, struct Light *lights, int lightcount, bool flatshaded) {
-    int Trianglenum = Object.trianglenum;
-    struct Triangle* Triangles = Object.triangles;
+// Set when the driver took a swap interval other than 0, the swaps then pace the frames
+bool SwapPaced = false;
 
-    // Push a matrix and apply the transformation
-    glPushMatrix();
-    glTranslatef(transform.px, transform.py, transform.pz);
-    glScalef(transform.sx, transform.sy, transform.sz);
-    glRotatef(transform.rx, 1, 0, 0);
-    glRotatef(transform.ry, 0, 1, 0);
-    glRotatef(transform.rz, 0, 0, 1);
-
-    for (int i = 0; i < Trianglenum; i++) {
-        if (!flatshaded) {
-            // Extract the vertex positions of the current triangle to compute the shading
-            struct vector3 A = {
-                Triangles[i].v1.x, 
-                Triangles[i].v1.y, 
-                Triangles[i].v1.z
-            };
-            struct vector3 B = {
-                Triangles[i].v2.x, 
-                Triangles[i].v2.y, 
-                Triangles[i].v2.z
-            };
-            struct vector3 C = {
-                Triangles[i].v3.x, 
-                Triangles[i].v3.y, 
-                Triangles[i].v3.z
-            };
-
-
-            // Account for rotation
-
-            rotatePoint3D(&A.x, &A.y, &A.z, transform.rx, transform.ry, transform.rz);
-            rotatePoint3D(&B.x, &B.y, &B.z, transform.rx, transform.ry, transform.rz);
-            rotatePoint3D(&C.x, &C.y, &C.z, transform.rx, transform.ry, transform.rz);
-
-            // Calculate the center point
-            struct vector3 center = {
-                (A.x + B.x + C.x) / 3,
-                (A.y + B.y + C.y) / 3,
-                (A.z + B.z + C.z) / 3
-            };
-
-            // Compute the shading
-            struct color Shade = LambertianDiffuse(ComputeNormal(A, B, C, angleToZero(center)), center, lights, lightcount);
-
-            DrawTriangle(Triangles[i], TextureID, Shade);//, colorptr[i]);
+
+// Asks the window system for a swap interval through whichever swap control extension it
+// has. Adaptive falls back to plain vsync where late swaps can not tear.
+bool SetSwapInterval(int interval) {
+    bool applied = false;
+
+    if (eglGetCurrentContext() != EGL_NO_CONTEXT && eglGetCurrentSurface(EGL_DRAW) != EGL_NO_SURFACE) {
+        // EGL has no late swap tearing
+        interval = interval < 0 ? -interval : interval;
+        applied = eglSwapInterval(eglGetCurrentDisplay(), interval) == EGL_TRUE;
+    }
+    else if (glXGetCurrentContext() != NULL) {
+        if (interval < 0 && !GLXEW_EXT_swap_control_tear) {
+            interval = -interval;
         }
-        else {
-            DrawTriangle(Triangles[i], TextureID, WHITE);
+
+        if (GLXEW_EXT_swap_control) {
+            glXSwapIntervalEXT(glXGetCurrentDisplay(), glXGetCurrentDrawable(), interval);
+            applied = true;
+        }
+        else if (interval >= 0 && GLXEW_MESA_swap_control) {
+            applied = glXSwapIntervalMESA(interval) == 0;
+        }
+        else if (interval > 0 && GLXEW_SGI_swap_control) {
+            // SGI can not turn vsync off
+            applied = glXSwapIntervalSGI(interval) == 0;
         }
     }
 
-    // Pop the matrix to avoid the current transform affecting other meshes
-    glPopMatrix();
+    if (!applied) {
+        printf("Swap interval %d (%s) is not supported, frames are paced by the timer\n", interval, SwapIntervalName(interval));
+        SwapPaced = false;
+        return false;
+    }
+
+    printf("Swap interval %d (%s)\n", interval, SwapIntervalName(interval));
+    SWAPINTERVAL = interval;
+    SwapPaced = interval != 0;
+    ResetFramePacing();
+    return true;
+}
+
+
+// Shows the frame in a window, or in headless mode keeps it and optionally writes it out
+void PresentFrame() {
+    if (!HEADLESS) {
+        glutSwapBuffers();
+        return;
+    }
+
+    if (FRAMEDUMPPREFIX != NULL) {
+        DumpFrame(HeadlessFrame);
+    }
+    HeadlessFrame++;
 }
 
 
 void display(void) {
+    long long framestart = ProfileBegin();
+    GpuTimerBeginFrame();
+
+    // Textures that finished decoding replace their placeholders before anything is drawn
+    UploadDecodedTextures(false);
+
+    GpuTimerBeginPass(GPUPASS_SCENE);
+
     // Clear the screen
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     if (TextureCount == 0 || TextureIDs == NULL || TextureIDs[0] == 0) {
         printf("Error: No valid texture loaded.\n");
+        GpuTimerEndPass();
         return;
     }
 
-    // Update the cube's rotation over time
-    static float angle = 0.0f;
-    angle += 1.0f; // Increment the angle for rotation
+    // Get the scene of the last two simulation steps and how far in between them this frame is
+    long long simulationstart = ProfileBegin();
+    struct SceneSnapshot* snapshot;
+    float alpha;
+    if (atomic_load_explicit(&SimulationRunning, memory_order_relaxed)) {
+        bool fresh;
+        snapshot = AcquireSceneSnapshot(&fresh);
+        if (fresh) {
+            ProfileAdd(PROFILE_LIGHTING, snapshot->lightingtime);
+        }
 
+        // The snapshot is at most a step old, so this draws about one step behind real time
+        alpha = (float)((MonotonicNanoseconds() - snapshot->steptime) / (double)SIMULATIONSTEPNS);
+        alpha = alpha < 0.0f ? 0.0f : alpha > 1.0f ? 1.0f : alpha;
+    }
+    else {
+        // Step the simulation at its fixed rate on this thread
+        static struct SceneSnapshot localsnapshot;
+        alpha = AdvanceSimulation();
+        BuildScene(&localsnapshot, previousstate, currentstate);
+        snapshot = &localsnapshot;
+    }
+    ProfileEnd(PROFILE_SIMULATION, simulationstart);
+
+    // A replay draws the recorded frame over the simulated one
+    if (REPLAYPATH != NULL && !ReplayFrame(snapshot)) {
+        // Every recorded frame was drawn
+        GpuTimerEndPass();
+        if (!HEADLESS) {
+            glutLeaveMainLoop();
+        }
+        return;
+    }
 
-    // Draw a Triangle with the right colors and positions using the vertex struct and DrawTriangle function
-    struct vertex vertices[3] = {
-        { .x = 1.0f, .y = 1.0f, .z = 0.0f, .r = 1.0f, .g = 0.0f, .b = 0.0f, .u = 1.0f, .v = 1.0f},
-        { .x = -1.0f, .y = -1.0f, .z = 0.0f, .r = 0.0f, .g = 1.0f, .b = 0.0f, .u = 0.0f, .v = 0.0f},
-        { .x = 1.0f, .y = -1.0f, .z = 0.0f, .r = 0.0f, .g = 0.0f, .b = 1.0f, .u = 1.0f, .v = 0.0f},
-    };
+    // Everything is drawn relative to the camera
+    camerapos = LerpTransform(snapshot->cameraprevious, snapshot->cameracurrent, alpha);
+    struct mat4 view = CameraMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glLoadMatrixf(view.m);
+    UpdateViewFrustum();
+    RecordFrame(camerapos, snapshot, alpha);
+
+    // Without a simulation thread the lighting jobs run now, gathered before anything is submitted
+    if (!snapshot->lit && !SHADERLIGHTING) {
+        LightSceneSnapshot(snapshot, lightptr, LIGHTAMOUNT, alpha);
+        ProfileAdd(PROFILE_LIGHTING, snapshot->lightingtime);
+    }
 
+    // Queue the scene, the queue sorts it by state and batches repeated meshes
+    long long submitstart = ProfileBegin();
+    for (int i = 0; i < snapshot->count; i++) {
+        struct SceneDraw* draw = &snapshot->draws[i];
+        struct Transform transform = LerpTransform(draw->previous, draw->current, alpha);
+        // A draw culled where it was lit can come into view at this frame's alpha, it is lit
+        // here then like without the simulation thread
+        if (snapshot->lit && draw->lit && !SHADERLIGHTING) {
+            RenderQueueSubmitShaded(&renderqueue, draw->mesh, transform, draw->texture, draw->layer, draw->shades);
+        }
+        else {
+            RenderQueueSubmit(&renderqueue, draw->mesh, transform, draw->texture, draw->layer, draw->flatshaded);
+        }
+    }
+    RenderQueueFlush(&renderqueue, lightptr, LIGHTAMOUNT);
+    GpuTimerEndPass();
+    ProfileEnd(PROFILE_SUBMIT, submitstart);
+
+    // Report how well the state sorting did every few seconds
+    static int framecount = 0;
+    if (++framecount % (TARGETFPS * 10) == 0) {
+        RenderQueueReport(&renderqueue);
+        GpuTimerReport();
+        FramePacingReport();
+    }
 
-    struct Triangle triangle = {
-        { .x = 1.0f, .y = 1.0f, .z = 0.0f, .r = 1.0f, .g = 0.0f, .b = 0.0f, .u = 1.0f, .v = 1.0f},
-        { .x = -1.0f, .y = -1.0f, .z = 0.0f, .r = 0.0f, .g = 1.0f, .b = 0.0f, .u = 0.0f, .v = 0.0f},
-        { .x = 1.0f, .y = -1.0f, .z = 0.0f, .r = 0.0f, .g = 0.0f, .b = 1.0f, .u = 1.0f, .v = 0.0f}  
-    };
+    if (PROFILERHUD) {
+        long long hudstart = ProfileBegin();
+        GpuTimerBeginPass(GPUPASS_HUD);
+        DrawHud();
+        GpuTimerEndPass();
+        ProfileEnd(PROFILE_HUD, hudstart);
+    }
 
-    struct Transform Transformation1 = {
-        .px = 0.0f, .py = 0.0f, .pz = 0.0f,
-        .sx = 1.0f, .sy = 1.0f, .sz = 1.0f,
-        .rx = angle, .ry = angle, .rz = 0.0f // Rotate around X and Y axes
-    };
+    // Swap buffers to display the rendered frame
+    long long swapstart = ProfileBegin();
+    PresentFrame();
+    ProfileEnd(PROFILE_SWAP, swapstart);
 
+    // Headless frames are not shown, their pacing means nothing
+    if (!HEADLESS) {
+        RecordPresent();
+    }
 
-    //struct Transform Transformation1 = {
-    //    .px = 0.0f, .py = 0.0f, .pz = 0.0f,
-    //    .sx = 1.0f, .sy = 1.0f, .sz = 1.0f,
-    //    .rx = 0.0f, .ry = 0.0f, .rz = 0.0f // Rotate around X and Y axes
-    //};
+    ProfileEnd(PROFILE_FRAME, framestart);
+    ProfileEndFrame();
+}
 
-    struct Transform Transformation2 = {
-        .px = 0.0f, .py = 0.0f, .pz = 0.0f,
-        .sx = 1.0f, .sy = 1.0f, .sz = 1.0f,
-        .rx = angle + 45.0f, .ry = angle + 45.0f, .rz = 0.0f // Rotate around X and Y axes
-    };
 
-    struct Transform Transformation3 = {
-        .px = 0.0f, .py = 0.0f, .pz = 0.0f,
-        .sx = 1.0f, .sy = 1.0f, .sz = 1.0f,
-        .rx = angle + 22.5f, .ry = angle + 22.5f, .rz = 0.0f // Rotate around X and Y axes
-    };
+void idle() {
+    // Only redraw when the next frame is due, instead of spinning as fast as possible.
+    // With vsync the swap already waits, sleeping as well would beat against the display
+    // and every so often make a frame miss its blank.
+    if (!SwapPaced) {
+        WaitForNextFrame();
+    }
+    glutPostRedisplay(); // Request a redraw
+}
 
-    // Draw the cube with the updated transformation
-    DrawMesh(objectptr[0], Transformation1, TextureIDs[0], lightptr, LIGHTAMOUNT, false);
-    DrawMesh(objectptr[1], Transformation2, TextureIDs[0], lightptr, LIGHTAMOUNT, false);
-    DrawMesh(objectptr[1], Transformation3, TextureIDs[0], lightptr, LIGHTAMOUNT, false);
 
-    // Swap buffers to display the rendered frame
-    glutSwapBuffers();
+// WASD flies, Q and E go down and up, the arrow keys turn the camera
+int CameraKey(unsigned char key) {
+    switch (key) {
+        case 'w': case 'W': return CAMERA_FORWARD;
+        case 's': case 'S': return CAMERA_BACK;
+        case 'a': case 'A': return CAMERA_LEFT;
+        case 'd': case 'D': return CAMERA_RIGHT;
+        case 'e': case 'E': return CAMERA_UP;
+        case 'q': case 'Q': return CAMERA_DOWN;
+    }
+    return 0;
 }
 
 
-void idle() {
-    glutPostRedisplay(); // Request a redraw
+int CameraSpecialKey(int key) {
+    switch (key) {
+        case GLUT_KEY_LEFT: return CAMERA_TURNLEFT;
+        case GLUT_KEY_RIGHT: return CAMERA_TURNRIGHT;
+        case GLUT_KEY_UP: return CAMERA_TURNUP;
+        case GLUT_KEY_DOWN: return CAMERA_TURNDOWN;
+    }
+    return 0;
 }
 
 
-void init() {
+void keyboard(unsigned char key, int x, int y) {
+    (void)x;
+    (void)y;
+
+    // Cycle vsync, off and adaptive
+    if (key == 'v' || key == 'V') {
+        int next = SWAPINTERVAL > 0 ? 0 : SWAPINTERVAL == 0 ? -1 : 1;
+        SetSwapInterval(next);
+        clock_gettime(CLOCK_MONOTONIC, &nextframe);
+    }
+
+    atomic_fetch_or(&CameraKeys, CameraKey(key));
+}
+
+
+void keyboardup(unsigned char key, int x, int y) {
+    (void)x;
+    (void)y;
+    atomic_fetch_and(&CameraKeys, ~CameraKey(key));
+}
+
+
+void special(int key, int x, int y) {
+    (void)x;
+    (void)y;
+    atomic_fetch_or(&CameraKeys, CameraSpecialKey(key));
+}
+
+
+void specialup(int key, int x, int y) {
+    (void)x;
+    (void)y;
+    atomic_fetch_and(&CameraKeys, ~CameraSpecialKey(key));
+}
+
+
+// Sets up GL state, shaders and the profiling tools, everything that does not depend on the scene
+void InitRenderer() {
     // Initialize GLEW after creating the window and OpenGL context
     glewExperimental = GL_TRUE;
-    if (glewInit() != GLEW_OK) {
+    GLenum glewstatus = glewInit();
+
+    // Without an X display GLEW can not load GLX, the GL functions themselves are loaded fine
+    if (glewstatus != GLEW_OK && !(HEADLESS && glewstatus == GLEW_ERROR_NO_GLX_DISPLAY)) {
         printf("GLEW initialization failed!\n");
         exit(1); // Exit if GLEW fails to initialize
     }
@@ -549,15 +6224,42 @@ void init() {
     glEnable(GL_TEXTURE_2D);
     glEnable(GL_DEPTH_TEST);
 
+    // CreateObject makes every mesh wind counter clockwise seen from outside
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_BACK);
+    glFrontFace(GL_CCW);
+
     // Set up the projection matrix
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
 
     // Set up a perspective view
     float AspectRatio = (float)WIDTH / (float)HEIGHT;
-    gluPerspective(FOV, AspectRatio, 0.1f, 100.0f);
+    gluPerspective(FOV, AspectRatio, NEARPLANE, FARPLANE);
+
+    InitProfiler();
+    InitJobSystem(JOBTHREADS);
+    InitTextureLoader();
+    SceneLighting = (struct MeshLighting*)calloc(MAXSCENEDRAWS, sizeof(struct MeshLighting));
+    if (SceneLighting == NULL) {
+        printf("Memory allocation failed for the scene lighting\n");
+        exit(1);
+    }
+    InitShaderLighting();
+    InitTextureArrays();
+    SelectLightingKernel();
+
+    if (PROFILERHUD) {
+        InitHud();
+    }
+    InitGpuTimer(GPUTIMINGCSV);
+}
 
-    const char* Textures[1] = {"cobblesmall.png"};
+
+void init() {
+    InitRenderer();
+
+    const char* Textures[2] = {"cobblesmall.png", "mosssmall.png"};
 
     // Load the cube model
     struct Triangle triangles[12] = {
@@ -588,11 +6290,12 @@ void init() {
 
     struct object TempCube = CreateObject(12, triangles);
 
-    objectptr[0].triangles = TempCube.triangles;
-    objectptr[0].trianglenum = TempCube.trianglenum;
-
-    objectptr[1].triangles = TempCube.triangles;
-    objectptr[1].trianglenum = TempCube.trianglenum;
+    // Both slots share the same GPU buffers, unless the second one comes from a file
+    objectptr[0] = TempCube;
+    objectptr[1] = TempCube;
+    if (MESHPATH != NULL && !LoadMesh(MESHPATH, &objectptr[1])) {
+        objectptr[1] = TempCube;
+    }
 
     struct Light light1 = {
         {0.0f, 0.0f, 3.0f},
@@ -611,25 +6314,130 @@ void init() {
         colorptr[i].a = 1.0f; // Alpha is always 1.0
     }
 
-    TextureCount = 1;
-    LoadMultipleTextures(1, Textures);
+    // With an atlas the meshes sample their image from a shared page, with an array texture
+    // from a layer of it. The array gets both images so the cubes can pick different layers
+    if (ATLASPATH != NULL && BuildTextureAtlas(ATLASPATH, 1, Textures, &textureatlas)) {
+        LoadAtlasTextures(&textureatlas);
+        RemapAtlasUVs(&objectptr[0], &textureatlas, 0);
+        if (objectptr[1].vao != objectptr[0].vao) {
+            RemapAtlasUVs(&objectptr[1], &textureatlas, 0);
+        }
+    }
+    else if (!LoadTextureArray(2, Textures)) {
+        LoadMultipleTextures(1, Textures);
+    }
+
+    // A fixed frame time means the frames have to come out the same every run, placeholders included
+    if (FIXEDFRAMETIME) {
+        FinishTextureLoads();
+    }
+
+    // The simulation flies the camera from where it starts out
+    previousstate.camera = camerapos;
+    currentstate.camera = camerapos;
+}
+
+
+// Counterpart of InitRenderer
+void FreeRenderer() {
+    if (LightingProgram != 0) {
+        glDeleteProgram(LightingProgram);
+    }
+    if (InstancedLightingProgram != 0) {
+        glDeleteProgram(InstancedLightingProgram);
+    }
+    if (LayeredLightingProgram != 0) {
+        glDeleteProgram(LayeredLightingProgram);
+        glDeleteProgram(InstancedLayeredLightingProgram);
+    }
+    if (InstanceBuffer != 0) {
+        glDeleteBuffers(1, &InstanceBuffer);
+    }
 
-    // Move the camera back
-    glTranslatef(0.0f, 0.0f, -5.0f);
+    FreeMeshLighting(&RenderLighting);
+    if (SceneLighting != NULL) {
+        for (int i = 0; i < MAXSCENEDRAWS; i++) {
+            FreeMeshLighting(&SceneLighting[i]);
+        }
+        free(SceneLighting);
+        SceneLighting = NULL;
+    }
+    FreeJobSystem();
+    FreeTextureLoader();
+    FreeRenderQueue(&renderqueue);
+
+    if (HudTexture != 0) {
+        glDeleteTextures(1, &HudTexture);
+        glDeleteVertexArrays(1, &HudVAO);
+        glDeleteBuffers(1, &HudVBO);
+    }
+    free(FontPixels);
+    FreeGpuTimer();
+    FreeProfiler();
 }
 
 
 void Cleanup() {
-	// Clean up all textures
-	if (TextureIDs != NULL) {
-		glDeleteTextures(TextureCount, TextureIDs);
-		free(TextureIDs);
+    // The simulation thread reads the objects, so it has to stop first
+    StopSimulationThread();
+
+	// Clean up all textures, the registry deletes each one with its last reference
+	for (int i = 0; i < TextureCount; i++) {
+		if (TextureIDs[i] != 0) {
+			ReleaseTexture(TextureIDs[i]);
+		}
 	}
+	free(TextureIDs);
+	free(TextureLayers);
+	TextureIDs = NULL;
+	TextureLayers = NULL;
+	TextureCount = 0;
+	FreeTextureAtlas(&textureatlas);
+	FreeTextureRegistry();
+
+    // objectptr[1] shares its buffers with objectptr[0] unless it was loaded, so only delete them once
+    if (objectptr[1].vao != objectptr[0].vao) {
+        DeleteObject(&objectptr[1]);
+    }
+    DeleteObject(&objectptr[0]);
     free(objectptr);
     free(colorptr);
+
+    FreeCameraPath();
+    FreeRenderer();
+}
+
+
+// Renders HEADLESSFRAMES frames as fast as possible without a window, then returns
+int RunHeadless() {
+    if (!CreateHeadlessContext()) {
+        return 1;
+    }
+
+    // Simulated time moves one frame per frame, so the output does not depend on how fast we render
+    FIXEDFRAMETIME = true;
+
+    init();
+    CreateHeadlessFramebuffer();
+
+    long long start = MonotonicNanoseconds();
+    for (int i = 0; i < HEADLESSFRAMES; i++) {
+        display();
+    }
+    glFinish();
+    double seconds = (MonotonicNanoseconds() - start) / 1e9;
+
+    printf("Rendered %d frames in %.3f s, %.1f frames per second on %s\n",
+           HEADLESSFRAMES, seconds, HEADLESSFRAMES / seconds, (const char*)glGetString(GL_RENDERER));
+
+    Cleanup();
+    DestroyHeadlessContext();
+    return 0;
 }
 
 
+// Programs like bench.c include this file for the engine and bring their own main
+#ifndef CALIUM_NO_MAIN
 // Main function
 int main(int argc, char** argv) {
     // Assign memory to all needed pointers
@@ -647,9 +6455,97 @@ int main(int argc, char** argv) {
 
     struct Light *lights;
     lights = (struct Light*)malloc(sizeof(*lights));
-    lightptr = (struct Light*)malloc(sizeof(struct Light) * LIGHTAMOUNT);
+    lightptr = (struct Light*)calloc(LIGHTAMOUNT, sizeof(struct Light));
+
+    RANDOMSEED = (unsigned int)time(NULL);
+
+    // Parse the engine options, GLUT's own options are skipped here and handled by glutInit
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu-lighting") == 0) {
+            SHADERLIGHTING = false;
+        }
+        else if (strcmp(argv[i], "--no-hud") == 0) {
+            PROFILERHUD = false;
+        }
+        else if (strcmp(argv[i], "--gpu-csv") == 0 && i + 1 < argc) {
+            // Write the GPU time of every pass and mesh batch per frame
+            GPUTIMINGCSV = argv[++i];
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            // Job worker threads besides the main one
+            JOBTHREADS = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--swap-interval") == 0 && i + 1 < argc) {
+            // 1 for vsync, 0 for off, -1 for adaptive
+            SWAPINTERVAL = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--single-thread") == 0) {
+            SIMULATIONTHREAD = false;
+        }
+        else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+            HEADLESS = true;
+            HEADLESSFRAMES = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--dump-frames") == 0 && i + 1 < argc) {
+            FRAMEDUMPPREFIX = argv[++i];
+        }
+        else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            // Wavefront OBJ file to draw instead of two of the cubes
+            MESHPATH = argv[++i];
+        }
+        else if (strcmp(argv[i], "--texture-arrays") == 0) {
+            // Same sized textures become the layers of one array texture
+            TEXTUREARRAYS = true;
+        }
+        else if (strcmp(argv[i], "--atlas") == 0 && i + 1 < argc) {
+            // Layout file of the texture atlas, packed and written when missing or out of date
+            ATLASPATH = argv[++i];
+        }
+        else if (strcmp(argv[i], "--no-mesh-cache") == 0) {
+            MESHCACHE = false;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            RANDOMSEED = (unsigned int)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            // Write the camera path of this run
+            RECORDPATH = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            // Draw the frames of a recorded camera path
+            REPLAYPATH = argv[++i];
+        }
+        else if (strcmp(argv[i], "--frame-csv") == 0 && i + 1 < argc) {
+            // Write the CPU time of every profiler zone per frame
+            FRAMETIMINGCSV = argv[++i];
+        }
+        else if (strcmp(argv[i], "--check-lighting") == 0) {
+            // Compare the SIMD lighting kernels against the scalar reference and quit
+            CheckLightingKernels();
+            return 0;
+        }
+    }
+
+    // A replay renders every recorded frame with the recorded seed, on this thread and with a
+    // fixed frame time, so nothing depends on timing. Headless it renders exactly those frames.
+    if (REPLAYPATH != NULL) {
+        if (!LoadCameraPath(REPLAYPATH)) {
+            return 1;
+        }
+        FIXEDFRAMETIME = true;
+        SIMULATIONTHREAD = false;
+        HEADLESSFRAMES = camerapath.framecount;
+    }
+    srand(RANDOMSEED);
+
+    if (RECORDPATH != NULL && !StartRecording(RECORDPATH)) {
+        return 1;
+    }
 
-    srand(time(NULL));
+    // No window and no main loop, just render the frames and quit
+    if (HEADLESS) {
+        return RunHeadless();
+    }
 
     // Initialize GLUT
     glutInit(&argc, argv);
@@ -668,11 +6564,22 @@ int main(int argc, char** argv) {
 
     // Register the draw function
     glutDisplayFunc(display);
+    glutKeyboardFunc(keyboard);
+    glutKeyboardUpFunc(keyboardup);
+    glutSpecialFunc(special);
+    glutSpecialUpFunc(specialup);
+
+    // Held keys fly the camera, repeats would only send more presses
+    glutIgnoreKeyRepeat(1);
 
-    // Limit the framerate
-    glutTimerFunc(FRAMETIME, fpsLimiter, 0);
+    SetSwapInterval(SWAPINTERVAL);
+
+    if (SIMULATIONTHREAD) {
+        StartSimulationThread();
+    }
 
-    // Register the idle function
+    // Register the idle function, it paces the frames to TARGETFPS
+    clock_gettime(CLOCK_MONOTONIC, &nextframe);
     glutIdleFunc(idle);
 
     // Register the cleanup function
@@ -683,3 +6590,4 @@ int main(int argc, char** argv) {
 
     return 0;
 }
+#endif